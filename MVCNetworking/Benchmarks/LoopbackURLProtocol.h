@@ -0,0 +1,56 @@
+/*
+ * File: LoopbackURLProtocol.h
+ * Contains: An in-process HTTP server stand-in for the networking benchmarks.
+ */
+
+#import <Foundation/Foundation.h>
+
+// Requests for http://<kLoopbackURLProtocolHost>/... never touch the network; 
+// they are answered by LoopbackURLProtocol according to the shared 
+// LoopbackServerConfiguration. Everything runs off timers on the run loop 
+// of the thread that started the load, so a response behaves like a slow, 
+// possibly flaky, server on the other end of a real connection.
+
+extern NSString *kLoopbackURLProtocolHost;
+
+@interface LoopbackServerConfiguration : NSObject {
+    NSTimeInterval _latency;
+    NSUInteger _bytesPerSecond;
+    double _errorRate;
+    NSUInteger _bodySize;
+    NSUInteger _chunkSize;
+}
+
+// Time between the request arriving and the response (or error) starting.
+@property (assign, readwrite) NSTimeInterval latency;
+
+// Per-response bandwidth; 0 means as fast as the run loop will go.
+@property (assign, readwrite) NSUInteger bytesPerSecond;
+
+// Probability (0 to 1) that a request fails with a dropped connection, which
+// RetryingHTTPOperation treats as retryable.
+@property (assign, readwrite) double errorRate;
+
+// Size of each response body and of the pieces it's delivered in.
+@property (assign, readwrite) NSUInteger bodySize;
+@property (assign, readwrite) NSUInteger chunkSize;
+
+@end
+
+@interface LoopbackURLProtocol : NSURLProtocol {
+    NSTimer *_timer;
+    NSUInteger _bytesSent;
+    unsigned int _randomState;
+}
+
+// The configuration used for new requests. Set it before starting any 
+// requests; it's not meant to change while they are in flight.
++ (LoopbackServerConfiguration *)configuration;
++ (void)setConfiguration:(LoopbackServerConfiguration *)configuration;
+
+// Counts of requests received and requests failed on purpose, including 
+// retries. Can be called from any thread.
++ (NSUInteger)requestCount;
++ (NSUInteger)errorCount;
+
+@end
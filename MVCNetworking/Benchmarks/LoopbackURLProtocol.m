@@ -0,0 +1,216 @@
+/*
+ * File: LoopbackURLProtocol.m
+ * Contains: An in-process HTTP server stand-in for the networking benchmarks.
+ */
+
+#import "LoopbackURLProtocol.h"
+
+#include <stdlib.h>
+
+NSString *kLoopbackURLProtocolHost = @"loopback.benchmark";
+
+@implementation LoopbackServerConfiguration
+
+- (id)init {
+    self = [super init];
+    if (self != nil) {
+        self->_latency = 0.01;
+        self->_bytesPerSecond = 0;
+        self->_errorRate = 0.0;
+        self->_bodySize = 16 * 1024;
+        self->_chunkSize = 4 * 1024;
+    }
+    return self;
+}
+
+@synthesize latency = _latency;
+@synthesize bytesPerSecond = _bytesPerSecond;
+@synthesize errorRate = _errorRate;
+@synthesize bodySize = _bodySize;
+@synthesize chunkSize = _chunkSize;
+
+@end
+
+@interface LoopbackURLProtocol () 
+
+@property (retain, readwrite) NSTimer *timer;
+
+- (void)scheduleTimerWithInterval:(NSTimeInterval)interval 
+                         selector:(SEL)selector;
+- (void)sendNextChunk;
+
+@end
+
+@implementation LoopbackURLProtocol
+
+static LoopbackServerConfiguration *sConfiguration;
+static volatile uint32_t sRequestCount;
+static volatile uint32_t sErrorCount;
+
+// All response bodies are carved out of this one zero-filled buffer so that
+// the server side doesn't show up in the client's allocation numbers.
+static uint8_t *sChunkBuffer;
+static NSUInteger sChunkBufferSize;
+
++ (LoopbackServerConfiguration *)configuration {
+    @synchronized(self) {
+        if (sConfiguration == nil) {
+            [self setConfiguration:
+             [[[LoopbackServerConfiguration alloc] init] autorelease]];
+            assert(sConfiguration != nil);
+        }
+        return [[sConfiguration retain] autorelease];
+    }
+}
+
++ (void)setConfiguration:(LoopbackServerConfiguration *)configuration {
+    assert(configuration != nil);
+    assert(configuration.chunkSize > 0);
+    @synchronized(self) {
+        [sConfiguration autorelease];
+        sConfiguration = [configuration retain];
+        
+        free(sChunkBuffer);
+        sChunkBufferSize = configuration.chunkSize;
+        sChunkBuffer = calloc(sChunkBufferSize, 1);
+        assert(sChunkBuffer != NULL);
+    }
+}
+
++ (NSUInteger)requestCount {
+    return sRequestCount;
+}
+
++ (NSUInteger)errorCount {
+    return sErrorCount;
+}
+
+#pragma mark * NSURLProtocol overrides
+
++ (BOOL)canInitWithRequest:(NSURLRequest *)request {
+    return [[[request URL] host] 
+            caseInsensitiveCompare:kLoopbackURLProtocolHost] == NSOrderedSame;
+}
+
++ (NSURLRequest *)canonicalRequestForRequest:(NSURLRequest *)request {
+    return request;
+}
+
+- (void)dealloc {
+    assert(self->_timer == nil);
+    [super dealloc];
+}
+
+@synthesize timer = _timer;
+
+- (void)startLoading {
+    uint32_t requestNumber;
+    
+    requestNumber = __sync_add_and_fetch(&sRequestCount, 1);
+    
+    // Seed from the request number so that a given run injects the same 
+    // errors into the same requests every time.
+    self->_randomState = requestNumber;
+    
+    [self scheduleTimerWithInterval:[[self class] configuration].latency 
+                           selector:@selector(latencyTimerDone:)];
+}
+
+- (void)stopLoading {
+    [self.timer invalidate];
+    self.timer = nil;
+}
+
+#pragma mark * Response generation
+
+- (void)scheduleTimerWithInterval:(NSTimeInterval)interval 
+                         selector:(SEL)selector {
+    assert(self.timer == nil);
+    self.timer = [NSTimer timerWithTimeInterval:interval 
+                                         target:self 
+                                       selector:selector 
+                                       userInfo:nil 
+                                        repeats:NO];
+    assert(self.timer != nil);
+    [[NSRunLoop currentRunLoop] addTimer:self.timer 
+                                 forMode:NSDefaultRunLoopMode];
+}
+
+- (void)latencyTimerDone:(NSTimer *)timer {
+    LoopbackServerConfiguration *configuration;
+    NSHTTPURLResponse *response;
+    double draw;
+    #pragma unused(timer)
+    
+    [self.timer invalidate];
+    self.timer = nil;
+    
+    configuration = [[self class] configuration];
+    draw = (double)rand_r(&self->_randomState) / (double)RAND_MAX;
+    if (draw < configuration.errorRate) {
+        __sync_add_and_fetch(&sErrorCount, 1);
+        [[self client] URLProtocol:self 
+                  didFailWithError:
+         [NSError errorWithDomain:NSURLErrorDomain 
+                             code:NSURLErrorNetworkConnectionLost 
+                         userInfo:nil]];
+        return;
+    }
+    
+    response = [[[NSHTTPURLResponse alloc] 
+                 initWithURL:[[self request] URL] 
+                  statusCode:200 
+                 HTTPVersion:@"HTTP/1.1" 
+                headerFields:[NSDictionary dictionaryWithObjectsAndKeys:
+                              @"application/octet-stream", @"Content-Type",
+                              [NSString stringWithFormat:@"%lu", 
+                               (unsigned long)configuration.bodySize], 
+                              @"Content-Length",
+                              nil]] autorelease];
+    assert(response != nil);
+    [[self client] URLProtocol:self 
+            didReceiveResponse:response 
+            cacheStoragePolicy:NSURLCacheStorageNotAllowed];
+    
+    [self sendNextChunk];
+}
+
+- (void)sendNextChunk {
+    LoopbackServerConfiguration *configuration;
+    NSUInteger chunkLength;
+    
+    configuration = [[self class] configuration];
+    
+    if (self->_bytesSent == configuration.bodySize) {
+        [[self client] URLProtocolDidFinishLoading:self];
+        return;
+    }
+    
+    chunkLength = configuration.bodySize - self->_bytesSent;
+    if (chunkLength > sChunkBufferSize) {
+        chunkLength = sChunkBufferSize;
+    }
+    [[self client] URLProtocol:self 
+                   didLoadData:[NSData dataWithBytesNoCopy:sChunkBuffer 
+                                                    length:chunkLength 
+                                              freeWhenDone:NO]];
+    self->_bytesSent += chunkLength;
+    
+    // Pace the next chunk to the configured bandwidth. Even when unlimited,
+    // we go back through the run loop so that chunks arrive as separate 
+    // callbacks, just as they would off the wire.
+    [self scheduleTimerWithInterval:(configuration.bytesPerSecond == 0) ? 
+                                    0.0 : 
+                                    (double)chunkLength / 
+                                    (double)configuration.bytesPerSecond
+                           selector:@selector(chunkTimerDone:)];
+}
+
+- (void)chunkTimerDone:(NSTimer *)timer {
+    #pragma unused(timer)
+    [self.timer invalidate];
+    self.timer = nil;
+    [self sendNextChunk];
+}
+
+@end
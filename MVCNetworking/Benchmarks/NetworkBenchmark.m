@@ -0,0 +1,586 @@
+/*
+ * File: NetworkBenchmark.m
+ * Contains: A load test for QHTTPOperation, RetryingHTTPOperation and 
+ * NetworkManager.
+ *
+ * The benchmark pushes a batch of requests through the real operation 
+ * classes and the real NetworkManager queues; only the server is fake (see 
+ * LoopbackURLProtocol). Options are read through NSUserDefaults, so they 
+ * use the usual "-key value" argument syntax:
+ *
+ *   -operations N        number of requests to run (2000)
+ *   -retrying YES|NO     use RetryingHTTPOperation rather than QHTTPOperation 
+ *                        (YES)
+ *   -coalesce YES|NO     batch main thread updates through 
+ *                        QMainThreadPublisher; NO sends one message per 
+ *                        update, as before the publisher existed (YES)
+ *   -latency S           server latency per request, in seconds (0.01)
+ *   -bytesPerSecond N    server bandwidth per response, 0 for unlimited (0)
+ *   -errorRate F         fraction of requests that drop the connection (0)
+ *   -bodySize N          response body size in bytes (16384)
+ *   -chunkSize N         response delivered in pieces of this size (4096)
+ *   -output PATH         write the JSON results here rather than to stdout
+ *   -baseline PATH       compare against the JSON results of an earlier run
+ *   -tolerance F         allowed regression against the baseline (0.10)
+ *   -retryDelays LIST    comma separated RetryingHTTPOperation back-off, in 
+ *                        seconds; empty for the production schedule 
+ *                        (0.1,0.2,0.5)
+ *   -deadline S          give up on operations still running after this 
+ *                        many seconds, 0 for no limit (120)
+ *
+ * Operations that miss the deadline are cancelled and reported as 
+ * stalledOperations; the latency and throughput figures only cover the 
+ * operations that finished. The process exits with 1 if any metric 
+ * regressed by more than the tolerance, if a gated run had stalled 
+ * operations, or if the baseline was recorded with different settings, so 
+ * a stored baseline can gate a build.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE     // for RUSAGE_THREAD
+#endif
+
+#import <Foundation/Foundation.h>
+#import <CoreFoundation/CoreFoundation.h>
+
+#include <stdlib.h>
+#include <sys/resource.h>
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#endif
+
+#import "NetworkManager.h"
+#import "QHTTPOperation.h"
+#import "RetryingHTTPOperation.h"
+#import "QMainThreadPublisher.h"
+#import "LoopbackURLProtocol.h"
+
+@interface BenchmarkDriver : NSObject {
+    NSUInteger _operationCount;
+    BOOL _retrying;
+    NSArray *_retryDelays;
+    NSTimeInterval _deadline;
+    
+    // main thread only
+    NSUInteger _completedCount;
+    NSUInteger _failureCount;
+    NSUInteger _retryCount;
+    NSUInteger _maximumRetryCount;
+    CFMutableDictionaryRef _operationToIndexMap;
+    NSTimeInterval *_startTimes;
+    NSTimeInterval *_latencies;
+}
+
+- (id)initWithOperationCount:(NSUInteger)operationCount 
+                    retrying:(BOOL)retrying 
+                 retryDelays:(NSArray *)retryDelays 
+                    deadline:(NSTimeInterval)deadline;
+
+// Runs all of the operations to completion; must be called on the main 
+// thread. Returns the results dictionary.
+- (NSDictionary *)run;
+
+@end
+
+@implementation BenchmarkDriver
+
+- (id)initWithOperationCount:(NSUInteger)operationCount 
+                    retrying:(BOOL)retrying 
+                 retryDelays:(NSArray *)retryDelays 
+                    deadline:(NSTimeInterval)deadline {
+    assert(operationCount > 0);
+    assert(deadline >= 0.0);
+    self = [super init];
+    if (self != nil) {
+        self->_operationCount = operationCount;
+        self->_retrying = retrying;
+        self->_retryDelays = [retryDelays copy];
+        self->_deadline = deadline;
+        
+        // Keyed by pointer, not by object, so that a lookup doesn't go 
+        // through -hash and -isEqual: on the operation.
+        self->_operationToIndexMap = 
+        CFDictionaryCreateMutable(NULL, 0, NULL, NULL);
+        assert(self->_operationToIndexMap != NULL);
+        
+        self->_startTimes = calloc(operationCount, sizeof(NSTimeInterval));
+        self->_latencies = calloc(operationCount, sizeof(NSTimeInterval));
+        assert((self->_startTimes != NULL) && (self->_latencies != NULL));
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [self->_retryDelays release];
+    CFRelease(self->_operationToIndexMap);
+    free(self->_startTimes);
+    free(self->_latencies);
+    [super dealloc];
+}
+
+static int CompareTimeIntervals(const void *a, const void *b) {
+    NSTimeInterval left = *(const NSTimeInterval *)a;
+    NSTimeInterval right = *(const NSTimeInterval *)b;
+    return (left < right) ? -1 : (left > right) ? 1 : 0;
+}
+
+// Returns the peak resident set size of the process, in bytes.
+static unsigned long long PeakMemoryBytes(void) {
+    struct rusage usage;
+    int junk;
+    junk = getrusage(RUSAGE_SELF, &usage);
+    assert(junk == 0);
+    #pragma unused(junk)
+#if defined(__APPLE__)
+    return (unsigned long long)usage.ru_maxrss;
+#else
+    return (unsigned long long)usage.ru_maxrss * 1024;
+#endif
+}
+
+// Returns the CPU time (user plus system) used so far by the calling thread.
+// On the main thread this covers everything the main thread does. That 
+// includes the run loop's cost of receiving each 
+// -performSelectorOnMainThread:... message, not just the publisher's 
+// actions.
+static NSTimeInterval ThreadCPUSeconds(void) {
+#if defined(__APPLE__)
+    thread_basic_info_data_t info;
+    mach_msg_type_number_t count;
+    mach_port_t thread;
+    kern_return_t kr;
+    
+    count = THREAD_BASIC_INFO_COUNT;
+    thread = mach_thread_self();
+    kr = thread_info(thread, THREAD_BASIC_INFO, (thread_info_t)&info, &count);
+    assert(kr == KERN_SUCCESS);
+    #pragma unused(kr)
+    (void) mach_port_deallocate(mach_task_self(), thread);
+    return info.user_time.seconds + info.user_time.microseconds / 1e6 + 
+           info.system_time.seconds + info.system_time.microseconds / 1e6;
+#else
+    struct rusage usage;
+    int junk;
+    junk = getrusage(RUSAGE_THREAD, &usage);
+    assert(junk == 0);
+    #pragma unused(junk)
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + 
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#endif
+}
+
+- (void)startOperationAtIndex:(NSUInteger)index {
+    NSURL *url;
+    NSMutableURLRequest *request;
+    NetworkManager *manager;
+    
+    manager = [NetworkManager shardManager];
+    url = [NSURL URLWithString:
+           [NSString stringWithFormat:@"http://%@/item/%lu", 
+            kLoopbackURLProtocolHost, (unsigned long)index]];
+    request = [manager requestToGetURL:url];
+    assert(request != nil);
+    
+    self->_startTimes[index] = [NSDate timeIntervalSinceReferenceDate];
+    if (self->_retrying) {
+        RetryingHTTPOperation *operation;
+        operation = [[[RetryingHTTPOperation alloc] 
+                      initWithRequest:request] autorelease];
+        operation.retryDelays = self->_retryDelays;
+        CFDictionarySetValue(self->_operationToIndexMap, operation, 
+                             (const void *)(uintptr_t)index);
+        [manager addNetworkManagementOperation:operation 
+                                finishedTarget:self 
+                                        action:@selector(operationDone:)];
+    } else {
+        QHTTPOperation *operation;
+        operation = [[[QHTTPOperation alloc] 
+                      initWithRequest:request] autorelease];
+        CFDictionarySetValue(self->_operationToIndexMap, operation, 
+                             (const void *)(uintptr_t)index);
+        [manager addNetworkTransferOperation:operation 
+                              finishedTarget:self 
+                                      action:@selector(operationDone:)];
+    }
+}
+
+// Called by NetworkManager on the main thread, which is the thread that 
+// queued the operation.
+- (void)operationDone:(QRunLoopOperation *)operation {
+    NSUInteger index;
+    const void *value;
+    Boolean found;
+    
+    assert([NSThread isMainThread]);
+    found = CFDictionaryGetValueIfPresent(self->_operationToIndexMap, 
+                                          operation, &value);
+    assert(found);
+    #pragma unused(found)
+    index = (NSUInteger)(uintptr_t)value;
+    CFDictionaryRemoveValue(self->_operationToIndexMap, operation);
+    
+    self->_latencies[self->_completedCount] = 
+    [NSDate timeIntervalSinceReferenceDate] - self->_startTimes[index];
+    self->_completedCount += 1;
+    
+    if (operation.error != nil) {
+        self->_failureCount += 1;
+    }
+    if ([operation isKindOfClass:[RetryingHTTPOperation class]]) {
+        NSUInteger retries;
+        retries = ((RetryingHTTPOperation *)operation).retryCount;
+        self->_retryCount += retries;
+        if (retries > self->_maximumRetryCount) {
+            self->_maximumRetryCount = retries;
+        }
+    }
+}
+
+- (NSDictionary *)run {
+    NSTimeInterval startTime;
+    NSTimeInterval elapsed;
+    NSUInteger index;
+    QMainThreadPublisher *publisher;
+    unsigned long long startMessageCount;
+    NSTimeInterval startMainThreadTime;
+    NSTimeInterval mainThreadTime;
+    NSDate *deadlineDate;
+    NSUInteger stalledCount;
+    
+    assert([NSThread isMainThread]);
+    
+    publisher = [QMainThreadPublisher sharedPublisher];
+    startMessageCount = publisher.mainThreadMessageCount;
+    startMainThreadTime = ThreadCPUSeconds();
+    startTime = [NSDate timeIntervalSinceReferenceDate];
+    for (index = 0; index < self->_operationCount; index++) {
+        NSAutoreleasePool *pool;
+        pool = [[NSAutoreleasePool alloc] init];
+        [self startOperationAtIndex:index];
+        [pool drain];
+    }
+    
+    deadlineDate = (self->_deadline == 0.0) ? [NSDate distantFuture] : 
+                   [NSDate dateWithTimeIntervalSinceReferenceDate:
+                    startTime + self->_deadline];
+    while ((self->_completedCount < self->_operationCount) && 
+           ([deadlineDate timeIntervalSinceNow] > 0.0)) {
+        NSAutoreleasePool *pool;
+        pool = [[NSAutoreleasePool alloc] init];
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode 
+                                 beforeDate:deadlineDate];
+        [pool drain];
+    }
+    elapsed = [NSDate timeIntervalSinceReferenceDate] - startTime;
+    mainThreadTime = ThreadCPUSeconds() - startMainThreadTime;
+    
+    // Anything left is stuck, typically waiting out a long retry back-off.
+    // Cancel it so that it can't skew the figures or keep the process busy.
+    stalledCount = self->_operationCount - self->_completedCount;
+    if (stalledCount != 0) {
+        const void **operations;
+        
+        operations = calloc(stalledCount, sizeof(*operations));
+        assert(operations != NULL);
+        assert((NSUInteger)CFDictionaryGetCount(self->_operationToIndexMap) == 
+               stalledCount);
+        CFDictionaryGetKeysAndValues(self->_operationToIndexMap, 
+                                     operations, NULL);
+        CFDictionaryRemoveAllValues(self->_operationToIndexMap);
+        for (index = 0; index < stalledCount; index++) {
+            [[NetworkManager shardManager] 
+             cancelOperation:(NSOperation *)operations[index]];
+        }
+        free(operations);
+        fprintf(stderr, "%lu operations missed the %.0f second deadline\n", 
+                (unsigned long)stalledCount, self->_deadline);
+    }
+    
+    qsort(self->_latencies, self->_completedCount, sizeof(NSTimeInterval), 
+          CompareTimeIntervals);
+    
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+            [NSNumber numberWithUnsignedInteger:self->_operationCount], 
+            @"operations",
+            [NSNumber numberWithUnsignedInteger:stalledCount], 
+            @"stalledOperations",
+            [NSNumber numberWithUnsignedInteger:self->_failureCount], 
+            @"failures",
+            [NSNumber numberWithUnsignedInteger:self->_retryCount], 
+            @"retries",
+            [NSNumber numberWithUnsignedInteger:self->_maximumRetryCount], 
+            @"maximumRetries",
+            [NSNumber numberWithUnsignedInteger:
+             [LoopbackURLProtocol requestCount]], 
+            @"serverRequests",
+            [NSNumber numberWithUnsignedInteger:
+             [LoopbackURLProtocol errorCount]], 
+            @"injectedErrors",
+            [NSNumber numberWithDouble:elapsed], 
+            @"seconds",
+            [NSNumber numberWithDouble:self->_completedCount / elapsed], 
+            @"throughput",
+            [NSNumber numberWithDouble:(self->_completedCount == 0) ? 0.0 : 
+             self->_latencies[(self->_completedCount - 1) * 50 / 100]], 
+            @"latencyP50",
+            [NSNumber numberWithDouble:(self->_completedCount == 0) ? 0.0 : 
+             self->_latencies[(self->_completedCount - 1) * 99 / 100]], 
+            @"latencyP99",
+            [NSNumber numberWithUnsignedLongLong:PeakMemoryBytes()], 
+            @"peakMemoryBytes",
+            [NSNumber numberWithDouble:
+             (publisher.mainThreadMessageCount - startMessageCount) / elapsed],
+            @"mainThreadMessagesPerSecond",
+            [NSNumber numberWithDouble:
+             mainThreadTime / elapsed],
+            @"mainThreadSecondsPerSecond",
+            nil];
+}
+
+@end
+
+/*
+ * Checks that the baseline was recorded with the same configuration as this
+ * run; otherwise its figures measure something else and comparing them 
+ * means nothing. Both dictionaries must have come out of 
+ * NSJSONSerialization, so that equal settings compare equal. Logs each 
+ * difference to stderr and returns YES if there were any.
+ */
+static BOOL ConfigurationsDiffer(NSDictionary *configuration, 
+                                 NSDictionary *baselineConfiguration) {
+    NSMutableSet *keys;
+    BOOL differ;
+    
+    if (![baselineConfiguration isKindOfClass:[NSDictionary class]]) {
+        fprintf(stderr, "baseline has no configuration\n");
+        return YES;
+    }
+    keys = [NSMutableSet setWithArray:[configuration allKeys]];
+    [keys addObjectsFromArray:[baselineConfiguration allKeys]];
+    differ = NO;
+    for (NSString *key in keys) {
+        id current;
+        id previous;
+        
+        current = [configuration objectForKey:key];
+        previous = [baselineConfiguration objectForKey:key];
+        if ((current == nil) || (previous == nil) || 
+            ![current isEqual:previous]) {
+            fprintf(stderr, "configuration mismatch: %s is %s, baseline %s\n", 
+                    [key UTF8String], 
+                    (current == nil) ? "missing" : 
+                    [[current description] UTF8String], 
+                    (previous == nil) ? "missing" : 
+                    [[previous description] UTF8String]);
+            differ = YES;
+        }
+    }
+    return differ;
+}
+
+/*
+ * Compares results against a baseline, logging each metric to stderr. 
+ * Returns YES if any metric got worse by more than tolerance.
+ */
+static BOOL CompareWithBaseline(NSDictionary *results, 
+                                NSDictionary *baseline, 
+                                double tolerance) {
+    static const struct {
+        const char *key;
+        BOOL higherIsBetter;
+    } kMetrics[] = {
+        { "throughput", YES },
+        { "latencyP50", NO },
+        { "latencyP99", NO },
+        { "peakMemoryBytes", NO },
+        { "mainThreadMessagesPerSecond", NO },
+        { "mainThreadSecondsPerSecond", NO },
+        { "retries", NO }
+    };
+    BOOL regressed;
+    size_t metricIndex;
+    
+    // A run with stalls measured something other than the baseline did, so 
+    // it can't pass the gate whatever its other figures say.
+    regressed = ([[results objectForKey:@"stalledOperations"] 
+                  unsignedIntegerValue] != 0);
+    if (regressed) {
+        fprintf(stderr, "stalled operations, results not comparable\n");
+    }
+    for (metricIndex = 0; 
+         metricIndex < (sizeof(kMetrics) / sizeof(kMetrics[0])); 
+         metricIndex++) {
+        NSString *key;
+        double current;
+        double previous;
+        double change;
+        BOOL worse;
+        
+        key = [NSString stringWithUTF8String:kMetrics[metricIndex].key];
+        if ([baseline objectForKey:key] == nil) {
+            continue;
+        }
+        current = [[results objectForKey:key] doubleValue];
+        previous = [[baseline objectForKey:key] doubleValue];
+        change = (previous == 0.0) ? 0.0 : (current - previous) / previous;
+        
+        worse = kMetrics[metricIndex].higherIsBetter ? 
+                (change < -tolerance) : (change > tolerance);
+        fprintf(stderr, "%-16s %14.4f %14.4f %+7.1f%%%s\n", 
+                [key UTF8String], previous, current, change * 100.0, 
+                worse ? "  REGRESSED" : "");
+        if (worse) {
+            regressed = YES;
+        }
+    }
+    return regressed;
+}
+
+int main(int argc, char *argv[]) {
+    NSAutoreleasePool *pool;
+    NSUserDefaults *userDefaults;
+    LoopbackServerConfiguration *configuration;
+    NSMutableArray *retryDelays;
+    BenchmarkDriver *driver;
+    NSDictionary *results;
+    NSDictionary *report;
+    NSData *reportData;
+    NSString *path;
+    int status;
+    #pragma unused(argc)
+    #pragma unused(argv)
+    
+    pool = [[NSAutoreleasePool alloc] init];
+    status = EXIT_SUCCESS;
+    
+    userDefaults = [NSUserDefaults standardUserDefaults];
+    [userDefaults registerDefaults:
+     [NSDictionary dictionaryWithObjectsAndKeys:
+      @"2000",  @"operations",
+      @"YES",   @"retrying",
+      @"YES",   @"coalesce",
+      @"0.01",  @"latency",
+      @"0",     @"bytesPerSecond",
+      @"0",     @"errorRate",
+      @"16384", @"bodySize",
+      @"4096",  @"chunkSize",
+      @"0.10",  @"tolerance",
+      @"0.1,0.2,0.5", @"retryDelays",
+      @"120",   @"deadline",
+      nil]];
+    
+    configuration = [[[LoopbackServerConfiguration alloc] init] autorelease];
+    configuration.latency = [userDefaults doubleForKey:@"latency"];
+    configuration.bytesPerSecond = 
+    (NSUInteger)[userDefaults integerForKey:@"bytesPerSecond"];
+    configuration.errorRate = [userDefaults doubleForKey:@"errorRate"];
+    configuration.bodySize = (NSUInteger)[userDefaults integerForKey:@"bodySize"];
+    configuration.chunkSize = 
+    (NSUInteger)[userDefaults integerForKey:@"chunkSize"];
+    [LoopbackURLProtocol setConfiguration:configuration];
+    [NSURLProtocol registerClass:[LoopbackURLProtocol class]];
+    [QMainThreadPublisher sharedPublisher].coalescing = 
+    [userDefaults boolForKey:@"coalesce"];
+    
+    retryDelays = nil;
+    for (NSString *component in 
+         [[userDefaults stringForKey:@"retryDelays"] 
+          componentsSeparatedByString:@","]) {
+        NSString *delay;
+        delay = [component stringByTrimmingCharactersInSet:
+                 [NSCharacterSet whitespaceCharacterSet]];
+        if ([delay length] != 0) {
+            if (retryDelays == nil) {
+                retryDelays = [NSMutableArray array];
+            }
+            [retryDelays addObject:
+             [NSNumber numberWithDouble:[delay doubleValue]]];
+        }
+    }
+    
+    driver = [[[BenchmarkDriver alloc] 
+               initWithOperationCount:
+               (NSUInteger)[userDefaults integerForKey:@"operations"]
+               retrying:[userDefaults boolForKey:@"retrying"] 
+               retryDelays:retryDelays 
+               deadline:[userDefaults doubleForKey:@"deadline"]] autorelease];
+    results = [driver run];
+    
+    report = [NSDictionary dictionaryWithObjectsAndKeys:
+              [NSDictionary dictionaryWithObjectsAndKeys:
+               [NSNumber numberWithInteger:
+                [userDefaults integerForKey:@"operations"]], 
+               @"operations",
+               [NSNumber numberWithBool:[userDefaults boolForKey:@"retrying"]],
+               @"retrying",
+               [NSNumber numberWithBool:[userDefaults boolForKey:@"coalesce"]],
+               @"coalesce",
+               [NSNumber numberWithDouble:configuration.latency], 
+               @"latency",
+               [NSNumber numberWithUnsignedInteger:configuration.bytesPerSecond],
+               @"bytesPerSecond",
+               [NSNumber numberWithDouble:configuration.errorRate], 
+               @"errorRate",
+               [NSNumber numberWithUnsignedInteger:configuration.bodySize], 
+               @"bodySize",
+               [NSNumber numberWithUnsignedInteger:configuration.chunkSize], 
+               @"chunkSize",
+               (retryDelays == nil) ? (id)[NSNull null] : (id)retryDelays, 
+               @"retryDelays",
+               [NSNumber numberWithDouble:
+                [userDefaults doubleForKey:@"deadline"]], 
+               @"deadline",
+               nil], 
+              @"configuration",
+              results, 
+              @"results",
+              nil];
+    reportData = [NSJSONSerialization dataWithJSONObject:report 
+                                                 options:NSJSONWritingPrettyPrinted
+                                                   error:NULL];
+    assert(reportData != nil);
+    
+    path = [userDefaults stringForKey:@"output"];
+    if (path != nil) {
+        [reportData writeToFile:path atomically:YES];
+    } else {
+        fwrite([reportData bytes], 1, [reportData length], stdout);
+        fputc('\n', stdout);
+    }
+    
+    path = [userDefaults stringForKey:@"baseline"];
+    if (path != nil) {
+        NSData *baselineData;
+        NSDictionary *baseline;
+        NSDictionary *current;
+        
+        baselineData = [NSData dataWithContentsOfFile:path];
+        baseline = (baselineData == nil) ? nil : 
+                   [NSJSONSerialization JSONObjectWithData:baselineData 
+                                                   options:0 
+                                                     error:NULL];
+        // Compare against our own report as parsed back from JSON, so that 
+        // both sides have the same types.
+        current = [NSJSONSerialization JSONObjectWithData:reportData 
+                                                  options:0 
+                                                    error:NULL];
+        assert(current != nil);
+        if (![baseline isKindOfClass:[NSDictionary class]]) {
+            fprintf(stderr, "could not read baseline %s\n", [path UTF8String]);
+            status = EXIT_FAILURE;
+        } else if (ConfigurationsDiffer(
+                       [current objectForKey:@"configuration"], 
+                       [baseline objectForKey:@"configuration"])) {
+            fprintf(stderr, "baseline %s was recorded with different "
+                    "settings; not comparing\n", [path UTF8String]);
+            status = EXIT_FAILURE;
+        } else if (CompareWithBaseline(results, 
+                                       [baseline objectForKey:@"results"], 
+                                       [userDefaults doubleForKey:@"tolerance"])) {
+            status = EXIT_FAILURE;
+        }
+    }
+    
+    [pool drain];
+    return status;
+}
@@ -4,6 +4,7 @@
  */
 
 #import <Foundation/Foundation.h>
+#import <CoreFoundation/CoreFoundation.h>
 
 
 @interface NetworkManager : NSObject {
@@ -14,7 +15,10 @@
     CFMutableDictionaryRef _runningOperationToTargetMap;
     CFMutableDictionaryRef _runningOperationToActionMap;
     CFMutableDictionaryRef _runningOperationToThreadMap;
+    CFMutableDictionaryRef _runningOperationToGroupMap;
+    CFMutableDictionaryRef _cancellationGroupToOperationsMap;
     NSUInteger _runningNetworkTransferCount;
+    BOOL _networkInUse;
 }
 
 // Returns the network manager singleton. can be called from any thread.
@@ -47,7 +51,9 @@
 // 5. When you queue an operation you must supply a target/action pair that is 
 // called when the operation completes without being cancelled.
 // 6. The target/action pair is called on the thread that added the operation to 
-// the queue. you have to ensure that this thread runs its run loop.
+// the queue. you have to ensure that this thread runs its run loop. 
+// Completions for the main thread are batched through QMainThreadPublisher, 
+// so a burst of them costs the main thread one run loop message.
 // 7. If you queue a network operation and that network operation supports the 
 // runLoopThread property and the value of that property is nil, this sets the 
 // run loop thread of the operation to the above-metioned internal networking 
@@ -68,6 +74,14 @@
 // 11. To simplify clean up, -cancelOperation: does nothing if the supplied 
 // operations is nil or if it is not currently queued.
 // 12. We don't do any prioritsation of operations.
+// 13. When you queue an operation you can also tag it with a cancellation 
+// group, which is any object that implements -hash and -isEqual: (a gallery,
+// a screen, a string). -cancelOperationsInGroup: cancels every operation 
+// still queued in that group with a single non-blocking call; the run loop
+// side of the cancellation costs one cross-thread message per run loop 
+// thread, not one blocking round trip per operation. Point 10 holds for 
+// groups too: if you cancel the group on the thread that queued its 
+// operations, none of their target/actions will be called afterwards.
 
 - (void)addNetworkManagementOperation:(NSOperation *)operation 
                        finishedTarget:(id)target
@@ -81,5 +95,23 @@
          finishedTarget:(id)target 
                  action:(SEL)action;
 
+- (void)addNetworkManagementOperation:(NSOperation *)operation 
+                       finishedTarget:(id)target
+                               action:(SEL)action
+                    cancellationGroup:(id)group;
+
+- (void)addNetworkTransferOperation:(NSOperation *)operation
+                     finishedTarget:(id)target
+                             action:(SEL)action
+                  cancellationGroup:(id)group;
+
+- (void)addCPUOperation:(NSOperation *)operation 
+         finishedTarget:(id)target 
+                 action:(SEL)action
+      cancellationGroup:(id)group;
+
 - (void)cancelOperation:(NSOperation *)operation;
+
+// Does nothing if group is nil or has no queued operations.
+- (void)cancelOperationsInGroup:(id)group;
 @end
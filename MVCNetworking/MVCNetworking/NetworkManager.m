@@ -1,14 +1,547 @@
-//
-//  NetworkManager.m
-//  MVCNetworking
-//
-//  Created by chenzefeng on 11-7-16.
-//  Copyright 2011年 __MyCompanyName__. All rights reserved.
-//
+/*
+ * File: NetworkManager.m
+ * A singleton to manage the core network interactions.
+ */
 
 #import "NetworkManager.h"
+#import "QMainThreadPublisher.h"
+#import "QRunLoopOperation.h"
 
+@interface NetworkManager () 
+
+// private properties
+@property (nonatomic, retain, readonly) NSThread *networkRunLoopThread;
+@property (nonatomic, retain, readonly) 
+NSOperationQueue *queueForNetworkManagement;
+@property (nonatomic, retain, readonly) 
+NSOperationQueue *queueForNetworkTransfers;
+@property (nonatomic, retain, readonly) NSOperationQueue *queueForCPU;
+
+@end
 
 @implementation NetworkManager
 
++ (NetworkManager *)shardManager {
+    static NetworkManager *sNetworkManager;
+    
+    // This can be called on any thread, so we synchronise. We only do this in
+    // the sNetworkManager case because, once sNetworkManager goes non-nil, it
+    // can never go nil again.
+    if (sNetworkManager == nil) {
+        @synchronized(self) {
+            if (sNetworkManager == nil) {
+                sNetworkManager = [[NetworkManager alloc] init];
+                assert(sNetworkManager != nil);
+            }
+        }
+    }
+    return sNetworkManager;
+}
+
+- (id)init {
+    // Can be called from any thread because it's only called by +shardManager
+    self = [super init];
+    if (self != nil) {
+        // Create the network management queue. We will run an unbounded 
+        // number of these operations in parallel because each one consumes
+        // minimal resources.
+        self->_queueForNetworkManagement = [[NSOperationQueue alloc] init];
+        assert(self->_queueForNetworkManagement != nil);
+        [self->_queueForNetworkManagement 
+         setMaxConcurrentOperationCount:NSIntegerMax];
+        
+        // Create the network transfer queue. We will run up to 4 simultaneous
+        // network requests.
+        self->_queueForNetworkTransfers = [[NSOperationQueue alloc] init];
+        assert(self->_queueForNetworkTransfers != nil);
+        [self->_queueForNetworkTransfers setMaxConcurrentOperationCount:4];
+        
+        // Create the CPU queue. In contrast to the network queues, we leave 
+        // maxConcurrentOperationCount set to the default, which means on 
+        // current iOS devices only one operation can be running at a time.
+        self->_queueForCPU = [[NSOperationQueue alloc] init];
+        assert(self->_queueForCPU != nil);
+        
+        // Create our various operation-to-blah maps. The target and thread 
+        // maps retain their values; the action map holds raw SELs.
+        self->_runningOperationToTargetMap = 
+        CFDictionaryCreateMutable(NULL, 0, 
+                                  &kCFTypeDictionaryKeyCallBacks, 
+                                  &kCFTypeDictionaryValueCallBacks);
+        assert(self->_runningOperationToTargetMap != NULL);
+        self->_runningOperationToActionMap = 
+        CFDictionaryCreateMutable(NULL, 0, 
+                                  &kCFTypeDictionaryKeyCallBacks, 
+                                  NULL);
+        assert(self->_runningOperationToActionMap != NULL);
+        self->_runningOperationToThreadMap = 
+        CFDictionaryCreateMutable(NULL, 0, 
+                                  &kCFTypeDictionaryKeyCallBacks, 
+                                  &kCFTypeDictionaryValueCallBacks);
+        assert(self->_runningOperationToThreadMap != NULL);
+        
+        // The group maps let us find every operation in a cancellation group
+        // without walking the other maps.
+        self->_runningOperationToGroupMap = 
+        CFDictionaryCreateMutable(NULL, 0, 
+                                  &kCFTypeDictionaryKeyCallBacks, 
+                                  &kCFTypeDictionaryValueCallBacks);
+        assert(self->_runningOperationToGroupMap != NULL);
+        self->_cancellationGroupToOperationsMap = 
+        CFDictionaryCreateMutable(NULL, 0, 
+                                  &kCFTypeDictionaryKeyCallBacks, 
+                                  &kCFTypeDictionaryValueCallBacks);
+        assert(self->_cancellationGroupToOperationsMap != NULL);
+        
+        // We run all of our network callbacks on a secondary thread to ensure
+        // that they don't contribute to main thread latency. Create and 
+        // configure that thread.
+        self->_networkRunLoopThread = 
+        [[NSThread alloc] initWithTarget:self 
+                                selector:@selector(networkRunLoopThreadEntry) 
+                                  object:nil];
+        assert(self->_networkRunLoopThread != nil);
+        [self->_networkRunLoopThread setName:@"networkRunLoopThread"];
+        if ([self->_networkRunLoopThread 
+             respondsToSelector:@selector(setThreadPriority:)]) {
+            [self->_networkRunLoopThread setThreadPriority:0.3];
+        }
+        [self->_networkRunLoopThread start];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    // This object lives for the entire life of the application. Getting it
+    // to support being deallocated would be quite tricky (particularly from a
+    // threading perspective), so we don't even try.
+    assert(NO);
+    [super dealloc];
+}
+
+/*
+ * This thread runs all of our network operation run loop callbacks.
+ */
+- (void)networkRunLoopThreadEntry {
+    assert(![NSThread isMainThread]);
+    while (YES) {
+        NSAutoreleasePool *pool;
+        pool = [[NSAutoreleasePool alloc] init];
+        assert(pool != nil);
+        [[NSRunLoop currentRunLoop] run];
+        [pool drain];
+    }
+    assert(NO);
+}
+
+@synthesize networkRunLoopThread = _networkRunLoopThread;
+@synthesize queueForNetworkManagement = _queueForNetworkManagement;
+@synthesize queueForNetworkTransfers = _queueForNetworkTransfers;
+@synthesize queueForCPU = _queueForCPU;
+
+- (NSMutableURLRequest *)requestToGetURL:(NSURL *)url {
+    NSMutableURLRequest *result;
+    static NSString *sUserAgentString;
+    assert(url != nil);
+    
+    // Create the request.
+    result = [NSMutableURLRequest requestWithURL:url];
+    assert(result != nil);
+    
+    // Set up the user agent string.
+    if (sUserAgentString == nil) {
+        @synchronized([self class]) {
+            if (sUserAgentString == nil) {
+                NSString *name;
+                NSString *version;
+                name = [[NSBundle mainBundle] 
+                        objectForInfoDictionaryKey:@"CFBundleName"];
+                if (name == nil) {
+                    name = @"MVCNetworking";
+                }
+                version = [[NSBundle mainBundle] 
+                           objectForInfoDictionaryKey:@"CFBundleVersion"];
+                if (version == nil) {
+                    version = @"1.0";
+                }
+                sUserAgentString = [[NSString alloc] 
+                                    initWithFormat:@"%@/%@", name, version];
+                assert(sUserAgentString != nil);
+            }
+        }
+    }
+    [result setValue:sUserAgentString forHTTPHeaderField:@"User-Agent"];
+    
+    return result;
+}
+
+#pragma mark * Operation dispatch
+
+/*
+ * We manually implement the networkInUse property because we need to change 
+ * it in response to changes in _runningNetworkTransferCount. The count is 
+ * updated atomically on any thread; _networkInUse is the main thread's view
+ * of it, brought up to date by -syncNetworkInUse.
+ */
+- (BOOL)networkInUse {
+    assert([NSThread isMainThread]);
+    return self->_networkInUse;
+}
+
++ (BOOL)automaticallyNotifiesObserversOfNetworkInUse {
+    return NO;
+}
+
+- (void)syncNetworkInUse {
+    BOOL newValue;
+    assert([NSThread isMainThread]);
+    // I base -networkInUse off the number of running operations, not the 
+    // number of running connections. This is probably not technically 
+    // correct, but it's close enough.
+    newValue = (self->_runningNetworkTransferCount != 0);
+    if (newValue != self->_networkInUse) {
+        [self willChangeValueForKey:@"networkInUse"];
+        self->_networkInUse = newValue;
+        [self didChangeValueForKey:@"networkInUse"];
+    }
+}
+
+- (void)incrementRunningNetworkTransferCount {
+    if (__sync_add_and_fetch(&self->_runningNetworkTransferCount, 1) == 1) {
+        [[QMainThreadPublisher sharedPublisher] 
+         publishToTarget:self 
+                  action:@selector(syncNetworkInUse) 
+              withObject:nil];
+    }
+}
+
+- (void)decrementRunningNetworkTransferCount {
+    if (__sync_sub_and_fetch(&self->_runningNetworkTransferCount, 1) == 0) {
+        [[QMainThreadPublisher sharedPublisher] 
+         publishToTarget:self 
+                  action:@selector(syncNetworkInUse) 
+              withObject:nil];
+    }
+}
+
+/*
+ * Removes the operation from all of our maps. Returns NO if it wasn't there,
+ * that is, if it has already completed or been cancelled. Must be called 
+ * with @synchronized(self) held.
+ */
+- (BOOL)removeOperationFromMaps:(NSOperation *)operation {
+    id group;
+    
+    if (CFDictionaryGetValue(self->_runningOperationToTargetMap, 
+                             operation) == NULL) {
+        return NO;
+    }
+    
+    group = (id)
+    CFDictionaryGetValue(self->_runningOperationToGroupMap, operation);
+    if (group != nil) {
+        CFMutableSetRef groupOperations;
+        groupOperations = (CFMutableSetRef)
+        CFDictionaryGetValue(self->_cancellationGroupToOperationsMap, group);
+        assert(groupOperations != NULL);
+        CFSetRemoveValue(groupOperations, operation);
+        if (CFSetGetCount(groupOperations) == 0) {
+            CFDictionaryRemoveValue(self->_cancellationGroupToOperationsMap, 
+                                    group);
+        }
+        CFDictionaryRemoveValue(self->_runningOperationToGroupMap, operation);
+    }
+    
+    CFDictionaryRemoveValue(self->_runningOperationToTargetMap, operation);
+    CFDictionaryRemoveValue(self->_runningOperationToActionMap, operation);
+    CFDictionaryRemoveValue(self->_runningOperationToThreadMap, operation);
+    return YES;
+}
+
+/*
+ * Core code to enqueue an operation on a queue.
+ */
+- (void)addOperation:(NSOperation *)operation 
+             toQueue:(NSOperationQueue *)queue
+      finishedTarget:(id)target 
+              action:(SEL)action 
+   cancellationGroup:(id)group {
+    assert(operation != nil);
+    assert(target != nil);
+    assert(action != nil);
+    
+    // If the operation supports a run loop thread and none has been set, 
+    // point it at our network thread (point 7 in the header).
+    if ([operation respondsToSelector:@selector(setRunLoopThread:)]) {
+        if ([(id)operation runLoopThread] == nil) {
+            [(id)operation setRunLoopThread:self.networkRunLoopThread];
+        }
+    }
+    
+    // Update our networkInUse property. We can be running on any thread; 
+    // the count is atomic and the property itself changes on the main thread.
+    if (queue == self.queueForNetworkTransfers) {
+        [self incrementRunningNetworkTransferCount];
+    }
+    
+    // Atomically enter the operation into our target, action and thread maps.
+    @synchronized(self) {
+        assert(CFDictionaryGetValue(self->_runningOperationToTargetMap, 
+                                    operation) == NULL);
+        CFDictionarySetValue(self->_runningOperationToTargetMap, 
+                             operation, target);
+        CFDictionarySetValue(self->_runningOperationToActionMap, 
+                             operation, action);
+        CFDictionarySetValue(self->_runningOperationToThreadMap, 
+                             operation, [NSThread currentThread]);
+        
+        if (group != nil) {
+            CFMutableSetRef groupOperations;
+            groupOperations = (CFMutableSetRef)
+            CFDictionaryGetValue(self->_cancellationGroupToOperationsMap, 
+                                 group);
+            if (groupOperations == NULL) {
+                groupOperations = 
+                CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks);
+                assert(groupOperations != NULL);
+                CFDictionarySetValue(self->_cancellationGroupToOperationsMap, 
+                                     group, groupOperations);
+                CFRelease(groupOperations);
+            }
+            CFSetAddValue(groupOperations, operation);
+            CFDictionarySetValue(self->_runningOperationToGroupMap, 
+                                 operation, group);
+        }
+    }
+    
+    // Observe the isFinished property of the operation. We pass the queue 
+    // as the context so that, in the completion routine, we know which queue
+    // the operation was sent to (necessary to decide whether to decrement 
+    // our running network transfer count).
+    [operation addObserver:self 
+                forKeyPath:@"isFinished" 
+                   options:0 
+                   context:queue];
+    
+    // Queue the operation. When the operation completes, -operationDone: is
+    // called.
+    [queue addOperation:operation];
+}
+
+- (void)addNetworkManagementOperation:(NSOperation *)operation 
+                       finishedTarget:(id)target
+                               action:(SEL)action {
+    [self addNetworkManagementOperation:operation 
+                         finishedTarget:target 
+                                 action:action 
+                      cancellationGroup:nil];
+}
+
+- (void)addNetworkTransferOperation:(NSOperation *)operation
+                     finishedTarget:(id)target
+                             action:(SEL)action {
+    [self addNetworkTransferOperation:operation 
+                       finishedTarget:target 
+                               action:action 
+                    cancellationGroup:nil];
+}
+
+- (void)addCPUOperation:(NSOperation *)operation 
+         finishedTarget:(id)target 
+                 action:(SEL)action {
+    [self addCPUOperation:operation 
+           finishedTarget:target 
+                   action:action 
+        cancellationGroup:nil];
+}
+
+- (void)addNetworkManagementOperation:(NSOperation *)operation 
+                       finishedTarget:(id)target
+                               action:(SEL)action
+                    cancellationGroup:(id)group {
+    [self addOperation:operation 
+               toQueue:self.queueForNetworkManagement 
+        finishedTarget:target 
+                action:action 
+     cancellationGroup:group];
+}
+
+- (void)addNetworkTransferOperation:(NSOperation *)operation
+                     finishedTarget:(id)target
+                             action:(SEL)action
+                  cancellationGroup:(id)group {
+    [self addOperation:operation 
+               toQueue:self.queueForNetworkTransfers 
+        finishedTarget:target 
+                action:action 
+     cancellationGroup:group];
+}
+
+- (void)addCPUOperation:(NSOperation *)operation 
+         finishedTarget:(id)target 
+                 action:(SEL)action
+      cancellationGroup:(id)group {
+    [self addOperation:operation 
+               toQueue:self.queueForCPU
+        finishedTarget:target 
+                action:action 
+     cancellationGroup:group];
+}
+
+/*
+ * Called by KVO when the isFinished property of an operation changes. This
+ * runs on whatever thread finished the operation, so we bounce the 
+ * completion to the thread that queued the operation.
+ */
+- (void)observeValueForKeyPath:(NSString *)keyPath 
+                      ofObject:(id)object 
+                        change:(NSDictionary *)change 
+                       context:(void *)context {
+    if ([keyPath isEqual:@"isFinished"]) {
+        NSOperation *operation;
+        NSOperationQueue *queue;
+        NSThread *thread;
+        
+        operation = (NSOperation *)object;
+        assert([operation isKindOfClass:[NSOperation class]]);
+        assert([operation isFinished]);
+        
+        queue = (NSOperationQueue *)context;
+        assert([queue isKindOfClass:[NSOperationQueue class]]);
+        
+        [operation removeObserver:self forKeyPath:@"isFinished"];
+        
+        @synchronized(self) {
+            thread = (NSThread *)
+            CFDictionaryGetValue(self->_runningOperationToThreadMap, operation);
+            if (thread != nil) {
+                [thread retain];
+            }
+        }
+        
+        // If the operation was cancelled, thread is nil and there's no 
+        // completion to deliver.
+        if (thread != nil) {
+            if ([thread isMainThread]) {
+                [[QMainThreadPublisher sharedPublisher] 
+                 publishToTarget:self 
+                          action:@selector(operationDone:) 
+                      withObject:operation];
+            } else {
+                [self performSelector:@selector(operationDone:) 
+                             onThread:thread 
+                           withObject:operation 
+                        waitUntilDone:NO];
+            }
+            [thread release];
+        }
+        
+        if (queue == self.queueForNetworkTransfers) {
+            [self decrementRunningNetworkTransferCount];
+        }
+    } else {
+        [super observeValueForKeyPath:keyPath 
+                             ofObject:object 
+                               change:change 
+                              context:context];
+    }
+}
+
+/*
+ * Called on the thread that queued the operation when the operation is done.
+ */
+- (void)operationDone:(NSOperation *)operation {
+    id target;
+    SEL action;
+    NSThread *thread;
+    
+    assert(operation != nil);
+    
+    // Find the target/action, if any, in the map and then remove all entries.
+    @synchronized(self) {
+        target = (id)
+        CFDictionaryGetValue(self->_runningOperationToTargetMap, operation);
+        action = (SEL)
+        CFDictionaryGetValue(self->_runningOperationToActionMap, operation);
+        thread = (NSThread *)
+        CFDictionaryGetValue(self->_runningOperationToThreadMap, operation);
+        assert((target != nil) == (thread != nil));
+        
+        // We need target to persist across the remove /and/ after we leave 
+        // the @synchronized block, so we retain it here.
+        if (target != nil) {
+            [[target retain] autorelease];
+            assert(thread == [NSThread currentThread]);
+            
+            (void)[self removeOperationFromMaps:operation];
+        }
+    }
+    
+    // If we removed the operation, call the target/action. However, we still
+    // have to test isCancelled here because it's possible that the operation
+    // was cancelled from some other thread; we don't deliver completions 
+    // for cancelled operations.
+    if (target != nil) {
+        if (![operation isCancelled]) {
+            [target performSelector:action withObject:operation];
+        }
+    }
+}
+
+- (void)cancelOperation:(NSOperation *)operation {
+    if (operation != nil) {
+        // Cancel the operation and then remove it from our maps. Once it's
+        // out of the maps, -operationDone: won't deliver its completion, 
+        // which is what gives us the same-thread guarantee (point 10 in 
+        // the header).
+        [operation cancel];
+        
+        @synchronized(self) {
+            (void)[self removeOperationFromMaps:operation];
+        }
+    }
+}
+
+- (void)cancelOperationsInGroup:(id)group {
+    NSArray *operations;
+    
+    if (group == nil) {
+        return;
+    }
+    
+    // Take the group's operations out of the maps first. That's what 
+    // stops their completions (see -operationDone:), and it's done in one
+    // go under the lock rather than once per operation.
+    operations = nil;
+    @synchronized(self) {
+        CFSetRef groupOperations;
+        groupOperations = (CFSetRef)
+        CFDictionaryGetValue(self->_cancellationGroupToOperationsMap, group);
+        if (groupOperations != NULL) {
+            CFIndex count;
+            const void **values;
+            
+            count = CFSetGetCount(groupOperations);
+            values = malloc(count * sizeof(*values));
+            assert(values != NULL);
+            CFSetGetValues(groupOperations, values);
+            operations = [[NSArray alloc] initWithObjects:(id *)values 
+                                                    count:count];
+            free(values);
+            
+            for (NSOperation *operation in operations) {
+                (void)[self removeOperationFromMaps:operation];
+            }
+            assert(CFDictionaryGetValue(self->_cancellationGroupToOperationsMap,
+                                        group) == NULL);
+        }
+    }
+    
+    // Then cancel them, without blocking on each operation's run loop thread.
+    if (operations != nil) {
+        [QRunLoopOperation cancelOperations:operations];
+        [operations release];
+    }
+}
+
 @end
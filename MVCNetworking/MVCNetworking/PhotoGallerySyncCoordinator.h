@@ -0,0 +1,172 @@
+/*
+ * File: PhotoGallerySyncCoordinator.h
+ * Contains: Shares NetworkManager fairly between several syncing galleries.
+ */
+
+#import <Foundation/Foundation.h>
+#import <CoreFoundation/CoreFoundation.h>
+
+enum PhotoGallerySyncQueue {
+    kPhotoGallerySyncQueueNetwork,
+    kPhotoGallerySyncQueueCPU,
+    kPhotoGallerySyncQueueCount
+};
+
+typedef enum PhotoGallerySyncQueue PhotoGallerySyncQueue;
+
+@class PhotoGallerySyncLane;
+
+// When several PhotoGallery objects sync at once, NetworkManager's queues 
+// run their operations in the order they were queued, so a big gallery's 
+// thumbnail flood sits in front of a small gallery's gallery XML fetch. 
+// PhotoGallerySyncCoordinator sits in front of NetworkManager and hands out
+// its capacity fairly:
+// 1. Each gallery gets a lane. Operations are queued on a lane rather than 
+// straight on NetworkManager, and the coordinator only lets a limited number
+// of them into NetworkManager at any one time.
+// 2. When there's room, the next operation is picked by deficit round-robin 
+// across the lanes that have work, separately for the network and CPU 
+// queues. Over time each busy lane gets a share of operations (or, if you 
+// supply costs, of cost) proportional to its weight, however deep any other 
+// lane's backlog is.
+// 3. Round-robin only orders work that hasn't started, and started work can
+// hold its slot for a long time (a RetryingHTTPOperation waiting out its 
+// back-off, say). So each lane with work on a queue is also guaranteed its 
+// weighted share of that queue's limit, at least one slot. A lane under its 
+// share may start work even when the limit is reached, which makes the 
+// limit soft: a lane that took idle slots while alone can't keep a newly 
+// busy lane waiting. A lane over its share only gets slots the limit has 
+// free.
+// 4. A lane can also be capped, both in how many operations it has running 
+// on each queue and in how many response bytes per second it may consume. 
+// Bytes are metered while they arrive, counting every attempt of a 
+// RetryingHTTPOperation and responses written to a file, and each network 
+// operation reserves its expected size when it starts, so a lane can't 
+// start a burst of transfers on the strength of one second's credit. A 
+// capped lane waits; it doesn't hold up the other lanes.
+// 5. Network lane operations go onto NetworkManager's network management 
+// queue, which is what RetryingHTTPOperation expects; the coordinator's own 
+// concurrency limit takes the place of the transfer queue width. CPU lane 
+// operations go onto the CPU queue.
+// 6. Each lane publishes observable progress and timing metrics.
+// 7. Like NetworkManager, the target/action is called on the main thread when
+// an operation completes without being cancelled. Everything here must be 
+// called on the main thread. If you cancel an operation you must do so using
+// -cancelOperation: or -cancelLane:, lest things get very confused. Both 
+// give the same guarantee as -[NetworkManager cancelOperation:]: the 
+// target/action will not be called afterwards.
+
+@interface PhotoGallerySyncCoordinator : NSObject {
+    NSMutableArray *_lanes;
+    NSUInteger _maximumConcurrentOperationCount[kPhotoGallerySyncQueueCount];
+    NSUInteger _runningOperationCount[kPhotoGallerySyncQueueCount];
+    NSUInteger _nextLaneIndex[kPhotoGallerySyncQueueCount];
+    NSUInteger _quantum;
+    CFMutableDictionaryRef _runningOperationToItemMap;
+    NSTimer *_quotaTimer;
+    NSTimer *_meterTimer;
+}
+
+// Returns the coordinator singleton. Must be called on the main thread.
++ (PhotoGallerySyncCoordinator *)sharedCoordinator;
+
+// How many operations the coordinator lets into NetworkManager at once, 
+// across all lanes, subject to the fair share guarantee in point 3 above. 
+// Default to 8 (network) and 1 (CPU).
+@property (nonatomic, assign, readwrite) 
+NSUInteger maximumConcurrentNetworkOperationCount;
+@property (nonatomic, assign, readwrite) 
+NSUInteger maximumConcurrentCPUOperationCount;
+
+// The deficit added to a lane, times its weight, each time round-robin 
+// reaches it. Use the same units as the costs you pass to 
+// -addOperation:...; the default of 1 suits the default cost of 1 per 
+// operation.
+@property (nonatomic, assign, readwrite) NSUInteger quantum;
+
+@property (nonatomic, copy, readonly) NSArray *lanes;
+
+- (PhotoGallerySyncLane *)addLaneWithName:(NSString *)name 
+                                   weight:(NSUInteger)weight;
+
+// Cancels everything on the lane and removes it.
+- (void)removeLane:(PhotoGallerySyncLane *)lane;
+
+// Queues operation on lane. cost is in quantum units; pass 1 unless some 
+// operations are known to be much more expensive than others. 
+- (void)addOperation:(NSOperation *)operation 
+              toLane:(PhotoGallerySyncLane *)lane 
+               queue:(PhotoGallerySyncQueue)queue 
+                cost:(NSUInteger)cost 
+      finishedTarget:(id)target 
+              action:(SEL)action;
+
+// Does nothing if the operation is nil or not queued on any lane.
+- (void)cancelOperation:(NSOperation *)operation;
+
+// Cancels every pending and running operation on the lane; the lane itself 
+// stays in place.
+- (void)cancelLane:(PhotoGallerySyncLane *)lane;
+
+@end
+
+@interface PhotoGallerySyncLane : NSObject {
+    NSString *_name;
+    NSUInteger _weight;
+    NSUInteger _maximumConcurrentOperationCount;
+    NSUInteger _maximumBytesPerSecond;
+    
+    // scheduler state, owned by the coordinator
+    NSMutableArray *_pendingItems[kPhotoGallerySyncQueueCount];
+    NSUInteger _deficit[kPhotoGallerySyncQueueCount];
+    BOOL _turnStarted[kPhotoGallerySyncQueueCount];
+    NSUInteger _queueRunningCount[kPhotoGallerySyncQueueCount];
+    double _byteCredit;
+    NSTimeInterval _byteCreditTime;
+    NSUInteger _finishedNetworkOperationCount;
+    unsigned long long _finishedNetworkByteCount;
+    
+    // metrics
+    NSUInteger _pendingCount;
+    NSUInteger _runningCount;
+    NSUInteger _completedCount;
+    NSUInteger _failedCount;
+    unsigned long long _bytesTransferred;
+    NSTimeInterval _totalWaitTime;
+    NSTimeInterval _maximumWaitTime;
+    NSTimeInterval _totalRunTime;
+}
+
+@property (nonatomic, copy, readonly) NSString *name;
+
+// Relative share of the coordinator's capacity; at least 1.
+@property (nonatomic, assign, readwrite) NSUInteger weight;
+
+// Per-lane quotas; 0, the default, means no limit beyond the coordinator's.
+// maximumConcurrentOperationCount applies to each queue separately, so a 
+// lane's network work at its cap doesn't stop its CPU work.
+@property (nonatomic, assign, readwrite) 
+NSUInteger maximumConcurrentOperationCount;
+@property (nonatomic, assign, readwrite) NSUInteger maximumBytesPerSecond;
+
+// observable, operations waiting in the lane, running and done, counting 
+// both queues
+@property (nonatomic, assign, readonly) NSUInteger pendingCount;
+@property (nonatomic, assign, readonly) NSUInteger runningCount;
+@property (nonatomic, assign, readonly) NSUInteger completedCount;
+@property (nonatomic, assign, readonly) NSUInteger failedCount;
+
+// observable, completed / (completed + running + pending), or 1.0 when idle
+@property (nonatomic, assign, readonly) double progress;
+
+// observable, response bytes received by the lane's network operations, 
+// running, finished and cancelled; updated a few times a second while 
+// they run
+@property (nonatomic, assign, readonly) unsigned long long bytesTransferred;
+
+// observable, time operations spent waiting in the lane and running
+@property (nonatomic, assign, readonly) NSTimeInterval totalWaitTime;
+@property (nonatomic, assign, readonly) NSTimeInterval maximumWaitTime;
+@property (nonatomic, assign, readonly) NSTimeInterval totalRunTime;
+
+@end
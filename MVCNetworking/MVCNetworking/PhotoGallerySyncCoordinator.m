@@ -0,0 +1,875 @@
+/*
+ * File: PhotoGallerySyncCoordinator.m
+ * Contains: Shares NetworkManager fairly between several syncing galleries.
+ */
+
+#import "PhotoGallerySyncCoordinator.h"
+#import "NetworkManager.h"
+#import "QHTTPOperation.h"
+#import "RetryingHTTPOperation.h"
+
+/*
+ * One queued operation and everything needed to complete it.
+ */
+@interface PhotoGallerySyncItem : NSObject {
+@public
+    NSOperation *_operation;
+    PhotoGallerySyncLane *_lane;    // not retained, the lane outlives us
+    PhotoGallerySyncQueue _queue;
+    NSUInteger _cost;
+    id _target;
+    SEL _action;
+    NSTimeInterval _queuedTime;
+    NSTimeInterval _startTime;
+    unsigned long long _chargedBytes;   // network only, metered so far
+    double _reservedBytes;              // network only, not yet used up
+}
+@end
+
+@implementation PhotoGallerySyncItem
+
+- (void)dealloc {
+    [self->_operation release];
+    [self->_target release];
+    [super dealloc];
+}
+
+@end
+
+@interface PhotoGallerySyncLane ()
+
+- (id)initWithName:(NSString *)name weight:(NSUInteger)weight;
+
+// read/write versions of public properties
+@property (nonatomic, assign, readwrite) NSUInteger pendingCount;
+@property (nonatomic, assign, readwrite) NSUInteger runningCount;
+@property (nonatomic, assign, readwrite) NSUInteger completedCount;
+@property (nonatomic, assign, readwrite) NSUInteger failedCount;
+@property (nonatomic, assign, readwrite) unsigned long long bytesTransferred;
+@property (nonatomic, assign, readwrite) NSTimeInterval totalWaitTime;
+@property (nonatomic, assign, readwrite) NSTimeInterval maximumWaitTime;
+@property (nonatomic, assign, readwrite) NSTimeInterval totalRunTime;
+
+- (NSMutableArray *)pendingItemsForQueue:(PhotoGallerySyncQueue)queue;
+- (NSUInteger)runningCountForQueue:(PhotoGallerySyncQueue)queue;
+- (void)adjustRunningCountForQueue:(PhotoGallerySyncQueue)queue
+                                by:(NSInteger)delta;
+- (double)byteCreditAtTime:(NSTimeInterval)now;
+- (double)reserveBytes;
+- (void)chargeBytes:(unsigned long long)bytes
+        reservation:(double *)reservation;
+- (void)refundReservation:(double)reservation;
+
+@end
+
+@implementation PhotoGallerySyncLane
+
++ (NSSet *)keyPathsForValuesAffectingProgress {
+    return [NSSet setWithObjects:@"pendingCount", @"runningCount",
+            @"completedCount", @"failedCount", nil];
+}
+
+- (id)initWithName:(NSString *)name weight:(NSUInteger)weight {
+    self = [super init];
+    if (self != nil) {
+        int queue;
+
+        self->_name = [name copy];
+        self->_weight = (weight == 0) ? 1 : weight;
+        for (queue = 0; queue < kPhotoGallerySyncQueueCount; queue++) {
+            self->_pendingItems[queue] = [[NSMutableArray alloc] init];
+            assert(self->_pendingItems[queue] != nil);
+        }
+        self->_byteCreditTime = [NSDate timeIntervalSinceReferenceDate];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    int queue;
+
+    for (queue = 0; queue < kPhotoGallerySyncQueueCount; queue++) {
+        [self->_pendingItems[queue] release];
+    }
+    [self->_name release];
+    [super dealloc];
+}
+
+@synthesize name = _name;
+@synthesize weight = _weight;
+@synthesize maximumConcurrentOperationCount = _maximumConcurrentOperationCount;
+@synthesize maximumBytesPerSecond = _maximumBytesPerSecond;
+@synthesize pendingCount = _pendingCount;
+@synthesize runningCount = _runningCount;
+@synthesize completedCount = _completedCount;
+@synthesize failedCount = _failedCount;
+@synthesize bytesTransferred = _bytesTransferred;
+@synthesize totalWaitTime = _totalWaitTime;
+@synthesize maximumWaitTime = _maximumWaitTime;
+@synthesize totalRunTime = _totalRunTime;
+
+- (void)setWeight:(NSUInteger)newValue {
+    self->_weight = (newValue == 0) ? 1 : newValue;
+}
+
+- (double)progress {
+    NSUInteger done;
+    NSUInteger total;
+
+    done = self.completedCount + self.failedCount;
+    total = done + self.runningCount + self.pendingCount;
+    return (total == 0) ? 1.0 : (double)done / (double)total;
+}
+
+- (NSMutableArray *)pendingItemsForQueue:(PhotoGallerySyncQueue)queue {
+    assert(queue < kPhotoGallerySyncQueueCount);
+    return self->_pendingItems[queue];
+}
+
+- (NSUInteger)runningCountForQueue:(PhotoGallerySyncQueue)queue {
+    assert(queue < kPhotoGallerySyncQueueCount);
+    return self->_queueRunningCount[queue];
+}
+
+/*
+ * Running counts are kept per queue, so that per-lane limits and fair
+ * shares apply to each queue separately; runningCount is their sum, for
+ * observers.
+ */
+- (void)adjustRunningCountForQueue:(PhotoGallerySyncQueue)queue
+                                by:(NSInteger)delta {
+    assert(queue < kPhotoGallerySyncQueueCount);
+    assert((delta > 0) ||
+           (self->_queueRunningCount[queue] >= (NSUInteger)-delta));
+    self->_queueRunningCount[queue] += delta;
+    self.runningCount += delta;
+}
+
+/*
+ * Brings the byte credit up to date and returns it. The credit refills at
+ * the quota rate, but never beyond one second's worth, so a lane that has
+ * been quiet gets only a short burst. Only meaningful when
+ * maximumBytesPerSecond is non-zero.
+ */
+- (double)byteCreditAtTime:(NSTimeInterval)now {
+    double rate;
+
+    rate = (double)self.maximumBytesPerSecond;
+    if (rate != 0.0) {
+        self->_byteCredit += (now - self->_byteCreditTime) * rate;
+        if (self->_byteCredit > rate) {
+            self->_byteCredit = rate;
+        }
+    }
+    self->_byteCreditTime = now;
+    return self->_byteCredit;
+}
+
+/*
+ * Called as a network operation starts. Takes what the lane's finished
+ * network operations averaged out of the credit, but no more than one
+ * second's worth (which is also the guess before anything has finished),
+ * so that a lane in credit can't start a burst of transfers before any of
+ * their bytes have been metered. Returns the amount taken, which the
+ * caller hands back to -chargeBytes:reservation: and -refundReservation:.
+ */
+- (double)reserveBytes {
+    double rate;
+    double estimate;
+
+    rate = (double)self.maximumBytesPerSecond;
+    if (rate == 0.0) {
+        return 0.0;
+    }
+    estimate = rate;
+    if (self->_finishedNetworkOperationCount != 0) {
+        estimate = (double)self->_finishedNetworkByteCount /
+                   (double)self->_finishedNetworkOperationCount;
+        if (estimate > rate) {
+            estimate = rate;
+        }
+    }
+    (void)[self byteCreditAtTime:[NSDate timeIntervalSinceReferenceDate]];
+    self->_byteCredit -= estimate;
+    return estimate;
+}
+
+/*
+ * Charges bytes that have arrived, using up the operation's reservation
+ * first. We only find out how big a response is as it arrives, so the
+ * credit is allowed to go negative; the lane then waits until it has paid
+ * the debt back.
+ */
+- (void)chargeBytes:(unsigned long long)bytes
+        reservation:(double *)reservation {
+    double reserved;
+
+    assert(reservation != NULL);
+
+    reserved = ((double)bytes < *reservation) ? (double)bytes : *reservation;
+    *reservation -= reserved;
+    (void)[self byteCreditAtTime:[NSDate timeIntervalSinceReferenceDate]];
+    if (self.maximumBytesPerSecond != 0) {
+        self->_byteCredit -= (double)bytes - reserved;
+    }
+    self.bytesTransferred += bytes;
+}
+
+/*
+ * Gives back what an operation reserved but didn't receive.
+ */
+- (void)refundReservation:(double)reservation {
+    if (reservation > 0.0) {
+        (void)[self byteCreditAtTime:[NSDate timeIntervalSinceReferenceDate]];
+        self->_byteCredit += reservation;
+    }
+}
+
+@end
+
+@interface PhotoGallerySyncCoordinator ()
+
+- (NSUInteger)fairShareForLane:(PhotoGallerySyncLane *)lane
+                         queue:(PhotoGallerySyncQueue)queue;
+- (BOOL)lane:(PhotoGallerySyncLane *)lane
+    canStartOnQueue:(PhotoGallerySyncQueue)queue
+             atTime:(NSTimeInterval)now;
+- (PhotoGallerySyncItem *)nextItemForQueue:(PhotoGallerySyncQueue)queue;
+- (void)pumpQueue:(PhotoGallerySyncQueue)queue;
+- (void)pump;
+- (void)scheduleQuotaTimer;
+- (void)quotaTimerDone:(NSTimer *)timer;
+- (unsigned long long)receivedByteCountForOperation:(NSOperation *)operation;
+- (void)meterItem:(PhotoGallerySyncItem *)item;
+- (void)scheduleMeterTimer;
+- (void)meterTimerDone:(NSTimer *)timer;
+- (void)operationDone:(NSOperation *)operation;
+- (void)removeRunningItem:(PhotoGallerySyncItem *)item;
+
+@end
+
+@implementation PhotoGallerySyncCoordinator
+
++ (PhotoGallerySyncCoordinator *)sharedCoordinator {
+    static PhotoGallerySyncCoordinator *sCoordinator;
+
+    assert([NSThread isMainThread]);
+    if (sCoordinator == nil) {
+        sCoordinator = [[PhotoGallerySyncCoordinator alloc] init];
+        assert(sCoordinator != nil);
+    }
+    return sCoordinator;
+}
+
+- (id)init {
+    self = [super init];
+    if (self != nil) {
+        self->_lanes = [[NSMutableArray alloc] init];
+        assert(self->_lanes != nil);
+
+        // Network lane operations are typically RetryingHTTPOperations,
+        // which can sit in a retry back-off without using a transfer; allow
+        // twice NetworkManager's transfer width so that they don't starve it.
+        self->_maximumConcurrentOperationCount[kPhotoGallerySyncQueueNetwork]
+        = 8;
+        self->_maximumConcurrentOperationCount[kPhotoGallerySyncQueueCPU] = 1;
+        self->_quantum = 1;
+
+        // The map retains both the operation and its item.
+        self->_runningOperationToItemMap =
+        CFDictionaryCreateMutable(NULL, 0,
+                                  &kCFTypeDictionaryKeyCallBacks,
+                                  &kCFTypeDictionaryValueCallBacks);
+        assert(self->_runningOperationToItemMap != NULL);
+    }
+    return self;
+}
+
+- (void)dealloc {
+    // This object lives for the entire life of the application. Getting it
+    // to support being deallocated would be quite tricky (particularly from a
+    // threading perspective), so we don't even try.
+    assert(NO);
+    [super dealloc];
+}
+
+- (NSUInteger)maximumConcurrentNetworkOperationCount {
+    return
+    self->_maximumConcurrentOperationCount[kPhotoGallerySyncQueueNetwork];
+}
+
+- (void)setMaximumConcurrentNetworkOperationCount:(NSUInteger)newValue {
+    assert(newValue != 0);
+    self->_maximumConcurrentOperationCount[kPhotoGallerySyncQueueNetwork]
+    = newValue;
+    [self pump];
+}
+
+- (NSUInteger)maximumConcurrentCPUOperationCount {
+    return self->_maximumConcurrentOperationCount[kPhotoGallerySyncQueueCPU];
+}
+
+- (void)setMaximumConcurrentCPUOperationCount:(NSUInteger)newValue {
+    assert(newValue != 0);
+    self->_maximumConcurrentOperationCount[kPhotoGallerySyncQueueCPU]
+    = newValue;
+    [self pump];
+}
+
+@synthesize quantum = _quantum;
+
+- (void)setQuantum:(NSUInteger)newValue {
+    assert(newValue != 0);
+    self->_quantum = newValue;
+}
+
+- (NSArray *)lanes {
+    return [[self->_lanes copy] autorelease];
+}
+
+#pragma mark * Lanes
+
+- (PhotoGallerySyncLane *)addLaneWithName:(NSString *)name
+                                   weight:(NSUInteger)weight {
+    PhotoGallerySyncLane *lane;
+
+    assert([NSThread isMainThread]);
+
+    lane = [[[PhotoGallerySyncLane alloc] initWithName:name
+                                                weight:weight] autorelease];
+    assert(lane != nil);
+    [self->_lanes addObject:lane];
+    return lane;
+}
+
+- (void)removeLane:(PhotoGallerySyncLane *)lane {
+    NSUInteger laneIndex;
+    int queue;
+
+    assert([NSThread isMainThread]);
+    assert(lane != nil);
+
+    laneIndex = [self->_lanes indexOfObjectIdenticalTo:lane];
+    if (laneIndex != NSNotFound) {
+        [self cancelLane:lane];
+
+        // Keep each round-robin position pointing at the same lane it
+        // pointed at before the removal (or at its successor, if it pointed
+        // at this lane).
+        for (queue = 0; queue < kPhotoGallerySyncQueueCount; queue++) {
+            if (self->_nextLaneIndex[queue] > laneIndex) {
+                self->_nextLaneIndex[queue] -= 1;
+            }
+        }
+        [self->_lanes removeObjectAtIndex:laneIndex];
+        for (queue = 0; queue < kPhotoGallerySyncQueueCount; queue++) {
+            if (self->_nextLaneIndex[queue] >= [self->_lanes count]) {
+                self->_nextLaneIndex[queue] = 0;
+            }
+        }
+
+        // The lane's departure raises everyone else's share.
+        [self pump];
+    }
+}
+
+#pragma mark * Operation management
+
+- (void)addOperation:(NSOperation *)operation
+              toLane:(PhotoGallerySyncLane *)lane
+               queue:(PhotoGallerySyncQueue)queue
+                cost:(NSUInteger)cost
+      finishedTarget:(id)target
+              action:(SEL)action {
+    PhotoGallerySyncItem *item;
+
+    assert([NSThread isMainThread]);
+    assert(operation != nil);
+    assert(lane != nil);
+    assert([self->_lanes indexOfObjectIdenticalTo:lane] != NSNotFound);
+    assert(queue < kPhotoGallerySyncQueueCount);
+    assert(target != nil);
+    assert(action != nil);
+
+    item = [[[PhotoGallerySyncItem alloc] init] autorelease];
+    assert(item != nil);
+    item->_operation = [operation retain];
+    item->_lane = lane;
+    item->_queue = queue;
+    item->_cost = (cost == 0) ? 1 : cost;
+    item->_target = [target retain];
+    item->_action = action;
+    item->_queuedTime = [NSDate timeIntervalSinceReferenceDate];
+
+    [[lane pendingItemsForQueue:queue] addObject:item];
+    lane.pendingCount += 1;
+
+    [self pumpQueue:queue];
+}
+
+- (void)cancelOperation:(NSOperation *)operation {
+    PhotoGallerySyncItem *item;
+    PhotoGallerySyncLane *lane;
+    NSMutableArray *pendingItems;
+    NSUInteger itemIndex;
+    int queue;
+
+    assert([NSThread isMainThread]);
+
+    if (operation == nil) {
+        return;
+    }
+
+    item = (PhotoGallerySyncItem *)
+    CFDictionaryGetValue(self->_runningOperationToItemMap, operation);
+    if (item != nil) {
+        queue = item->_queue;
+        [[NetworkManager shardManager] cancelOperation:operation];
+        [self removeRunningItem:item];
+        [self pumpQueue:queue];
+        return;
+    }
+
+    for (lane in self->_lanes) {
+        for (queue = 0; queue < kPhotoGallerySyncQueueCount; queue++) {
+            pendingItems = [lane pendingItemsForQueue:queue];
+            for (itemIndex = 0; itemIndex < [pendingItems count]; itemIndex++) {
+                item = [pendingItems objectAtIndex:itemIndex];
+                if (item->_operation == operation) {
+                    [pendingItems removeObjectAtIndex:itemIndex];
+                    lane.pendingCount -= 1;
+                    return;
+                }
+            }
+        }
+    }
+}
+
+- (void)cancelLane:(PhotoGallerySyncLane *)lane {
+    NSMutableArray *pendingItems;
+    CFIndex itemCount;
+    const void **items;
+    CFIndex itemIndex;
+    PhotoGallerySyncItem *item;
+    int queue;
+
+    assert([NSThread isMainThread]);
+    assert(lane != nil);
+
+    for (queue = 0; queue < kPhotoGallerySyncQueueCount; queue++) {
+        pendingItems = [lane pendingItemsForQueue:queue];
+        lane.pendingCount -= [pendingItems count];
+        [pendingItems removeAllObjects];
+    }
+
+    // Each lane is its own NetworkManager cancellation group, so one call
+    // takes out all of its running operations. NetworkManager won't call us
+    // back for them, so settle the books here. Removing an item releases
+    // only that item, so the others we copied out of the map stay valid.
+    [[NetworkManager shardManager] cancelOperationsInGroup:lane];
+    itemCount = CFDictionaryGetCount(self->_runningOperationToItemMap);
+    if (itemCount != 0) {
+        items = malloc(itemCount * sizeof(*items));
+        assert(items != NULL);
+        CFDictionaryGetKeysAndValues(self->_runningOperationToItemMap,
+                                     NULL, items);
+        for (itemIndex = 0; itemIndex < itemCount; itemIndex++) {
+            item = (PhotoGallerySyncItem *) items[itemIndex];
+            if (item->_lane == lane) {
+                [self removeRunningItem:item];
+            }
+        }
+        free(items);
+    }
+
+    [self pump];
+}
+
+/*
+ * Removes a running item from our books, keeping the counts straight, and
+ * settles its byte charge: whatever arrived is charged, cancelled or not,
+ * and whatever it reserved beyond that goes back to the lane. The map
+ * holds the last reference to the item, so callers that still need it
+ * afterwards must retain it first.
+ */
+- (void)removeRunningItem:(PhotoGallerySyncItem *)item {
+    assert(item != nil);
+    assert(self->_runningOperationCount[item->_queue] != 0);
+
+    if (item->_queue == kPhotoGallerySyncQueueNetwork) {
+        [self meterItem:item];
+        [item->_lane refundReservation:item->_reservedBytes];
+        item->_reservedBytes = 0.0;
+    }
+    self->_runningOperationCount[item->_queue] -= 1;
+    [item->_lane adjustRunningCountForQueue:item->_queue by:-1];
+    CFDictionaryRemoveValue(self->_runningOperationToItemMap,
+                            item->_operation);
+}
+
+#pragma mark * Scheduling
+
+/*
+ * Returns the number of slots on queue that lane is guaranteed, namely its
+ * weighted share of the queue's limit among the lanes that have work on the
+ * queue (pending or running), and at least one.
+ */
+- (NSUInteger)fairShareForLane:(PhotoGallerySyncLane *)lane
+                         queue:(PhotoGallerySyncQueue)queue {
+    NSUInteger activeWeight;
+    NSUInteger share;
+    PhotoGallerySyncLane *otherLane;
+
+    activeWeight = 0;
+    for (otherLane in self->_lanes) {
+        if (([[otherLane pendingItemsForQueue:queue] count] != 0) ||
+            ([otherLane runningCountForQueue:queue] != 0)) {
+            activeWeight += otherLane.weight;
+        }
+    }
+    if (activeWeight == 0) {
+        activeWeight = lane.weight;
+    }
+    share = (self->_maximumConcurrentOperationCount[queue] * lane.weight) /
+            activeWeight;
+    return (share == 0) ? 1 : share;
+}
+
+/*
+ * Returns whether the lane has work that it may start now. Its own quotas
+ * come first. After that it may use a free slot under the queue's limit, or
+ * go over the limit while it's running less than its fair share; see point
+ * 3 in the header for why.
+ */
+- (BOOL)lane:(PhotoGallerySyncLane *)lane
+    canStartOnQueue:(PhotoGallerySyncQueue)queue
+             atTime:(NSTimeInterval)now {
+    NSUInteger laneRunning;
+
+    if ([[lane pendingItemsForQueue:queue] count] == 0) {
+        return NO;
+    }
+    laneRunning = [lane runningCountForQueue:queue];
+    if ((lane.maximumConcurrentOperationCount != 0) &&
+        (laneRunning >= lane.maximumConcurrentOperationCount)) {
+        return NO;
+    }
+    if ((queue == kPhotoGallerySyncQueueNetwork) &&
+        (lane.maximumBytesPerSecond != 0) &&
+        ([lane byteCreditAtTime:now] < 0.0)) {
+        return NO;
+    }
+    if (self->_runningOperationCount[queue] <
+        self->_maximumConcurrentOperationCount[queue]) {
+        return YES;
+    }
+    return (laneRunning < [self fairShareForLane:lane queue:queue]);
+}
+
+/*
+ * Picks the next item to start using deficit round-robin. Each time the
+ * round-robin reaches a lane that can start work, the lane's deficit grows
+ * by quantum * weight; it then keeps the turn for as long as the deficit
+ * covers its head item. A lane that can't start work loses its turn and its
+ * deficit, so nobody banks credit while idle or over quota.
+ */
+- (PhotoGallerySyncItem *)nextItemForQueue:(PhotoGallerySyncQueue)queue {
+    NSUInteger laneCount;
+    NSUInteger visited;
+    BOOL anyEligible;
+    NSTimeInterval now;
+    PhotoGallerySyncLane *lane;
+    PhotoGallerySyncItem *item;
+    NSMutableArray *pendingItems;
+
+    laneCount = [self->_lanes count];
+    if (laneCount == 0) {
+        return nil;
+    }
+
+    now = [NSDate timeIntervalSinceReferenceDate];
+    visited = 0;
+    anyEligible = NO;
+    while (YES) {
+        lane = [self->_lanes objectAtIndex:self->_nextLaneIndex[queue]];
+        if (![self lane:lane canStartOnQueue:queue atTime:now]) {
+            lane->_deficit[queue] = 0;
+            lane->_turnStarted[queue] = NO;
+        } else {
+            anyEligible = YES;
+            if (!lane->_turnStarted[queue]) {
+                lane->_deficit[queue] += self.quantum * lane.weight;
+                lane->_turnStarted[queue] = YES;
+            }
+            pendingItems = [lane pendingItemsForQueue:queue];
+            item = [pendingItems objectAtIndex:0];
+            if (item->_cost <= lane->_deficit[queue]) {
+                lane->_deficit[queue] -= item->_cost;
+                [[item retain] autorelease];
+                [pendingItems removeObjectAtIndex:0];
+                return item;
+            }
+            lane->_turnStarted[queue] = NO;
+        }
+
+        self->_nextLaneIndex[queue] =
+        (self->_nextLaneIndex[queue] + 1) % laneCount;
+
+        // Eligible lanes gain deficit on every pass, so as long as one
+        // exists we'll eventually pick something. Once a full pass finds
+        // none, stop.
+        visited += 1;
+        if (visited == laneCount) {
+            if (!anyEligible) {
+                return nil;
+            }
+            visited = 0;
+            anyEligible = NO;
+        }
+    }
+}
+
+/*
+ * Moves items from the lanes into NetworkManager for as long as some lane
+ * may start one. Each start raises the counts that -lane:canStartOnQueue:
+ * checks, so this terminates.
+ */
+- (void)pumpQueue:(PhotoGallerySyncQueue)queue {
+    PhotoGallerySyncItem *item;
+    PhotoGallerySyncLane *lane;
+    NetworkManager *manager;
+    NSTimeInterval waitTime;
+
+    manager = [NetworkManager shardManager];
+    while (YES) {
+        item = [self nextItemForQueue:queue];
+        if (item == nil) {
+            break;
+        }
+        lane = item->_lane;
+
+        item->_startTime = [NSDate timeIntervalSinceReferenceDate];
+        waitTime = item->_startTime - item->_queuedTime;
+        lane.pendingCount -= 1;
+        lane.totalWaitTime += waitTime;
+        if (waitTime > lane.maximumWaitTime) {
+            lane.maximumWaitTime = waitTime;
+        }
+        [lane adjustRunningCountForQueue:queue by:1];
+        self->_runningOperationCount[queue] += 1;
+        CFDictionarySetValue(self->_runningOperationToItemMap,
+                             item->_operation, item);
+
+        if (queue == kPhotoGallerySyncQueueNetwork) {
+            item->_reservedBytes = [lane reserveBytes];
+            [manager addNetworkManagementOperation:item->_operation
+                                    finishedTarget:self
+                                            action:@selector(operationDone:)
+                                 cancellationGroup:lane];
+        } else {
+            [manager addCPUOperation:item->_operation
+                      finishedTarget:self
+                              action:@selector(operationDone:)
+                   cancellationGroup:lane];
+        }
+    }
+
+    if (queue == kPhotoGallerySyncQueueNetwork) {
+        [self scheduleQuotaTimer];
+        [self scheduleMeterTimer];
+    }
+}
+
+- (void)pump {
+    int queue;
+
+    for (queue = 0; queue < kPhotoGallerySyncQueueCount; queue++) {
+        [self pumpQueue:queue];
+    }
+}
+
+/*
+ * If some lane has network work that is held back only by its byte quota,
+ * arranges to pump again when the earliest such lane is back in credit.
+ * Nothing else would wake us up in that case.
+ */
+- (void)scheduleQuotaTimer {
+    NSTimeInterval now;
+    NSTimeInterval delay;
+    NSTimeInterval earliest;
+    double credit;
+    PhotoGallerySyncLane *lane;
+
+    if (self->_quotaTimer != nil) {
+        return;
+    }
+
+    now = [NSDate timeIntervalSinceReferenceDate];
+    earliest = -1.0;
+    for (lane in self->_lanes) {
+        if ((lane.maximumBytesPerSecond != 0) &&
+            ([[lane pendingItemsForQueue:kPhotoGallerySyncQueueNetwork] count]
+             != 0)) {
+            credit = [lane byteCreditAtTime:now];
+            if (credit < 0.0) {
+                delay = -credit / (double)lane.maximumBytesPerSecond;
+                if ((earliest < 0.0) || (delay < earliest)) {
+                    earliest = delay;
+                }
+            }
+        }
+    }
+    if (earliest >= 0.0) {
+        self->_quotaTimer =
+        [[NSTimer scheduledTimerWithTimeInterval:earliest
+                                          target:self
+                                        selector:@selector(quotaTimerDone:)
+                                        userInfo:nil
+                                         repeats:NO] retain];
+    }
+}
+
+- (void)quotaTimerDone:(NSTimer *)timer {
+    assert(timer == self->_quotaTimer);
+    #pragma unused(timer)
+
+    [self->_quotaTimer release];
+    self->_quotaTimer = nil;
+    [self pumpQueue:kPhotoGallerySyncQueueNetwork];
+}
+
+#pragma mark * Byte metering
+
+/*
+ * Returns how many response bytes operation has received so far. Our own
+ * operations count them as they arrive, whether they are kept in memory or
+ * written to a file; for anything else, all we can see is the response
+ * once it's complete.
+ */
+- (unsigned long long)receivedByteCountForOperation:(NSOperation *)operation {
+    if ([operation respondsToSelector:@selector(receivedByteCount)]) {
+        return [(id)operation receivedByteCount];
+    } else if ([operation respondsToSelector:@selector(responseContent)]) {
+        return [[(id)operation responseContent] length];
+    } else if ([operation respondsToSelector:@selector(responseBody)]) {
+        return [[(id)operation responseBody] length];
+    }
+    return 0;
+}
+
+/*
+ * Charges the item's lane for whatever has arrived since we last looked.
+ * A RetryingHTTPOperation's count can dip briefly between attempts, so we
+ * only ever move forward.
+ */
+- (void)meterItem:(PhotoGallerySyncItem *)item {
+    unsigned long long received;
+
+    assert(item->_queue == kPhotoGallerySyncQueueNetwork);
+
+    received = [self receivedByteCountForOperation:item->_operation];
+    if (received > item->_chargedBytes) {
+        [item->_lane chargeBytes:received - item->_chargedBytes
+                     reservation:&item->_reservedBytes];
+        item->_chargedBytes = received;
+    }
+}
+
+/*
+ * While network operations are running, meters them a few times a second,
+ * so that a lane's credit runs down as its bytes arrive rather than all at
+ * once when an operation completes.
+ */
+- (void)scheduleMeterTimer {
+    if ((self->_meterTimer == nil) &&
+        (self->_runningOperationCount[kPhotoGallerySyncQueueNetwork] != 0)) {
+        self->_meterTimer =
+        [[NSTimer scheduledTimerWithTimeInterval:0.25
+                                          target:self
+                                        selector:@selector(meterTimerDone:)
+                                        userInfo:nil
+                                         repeats:YES] retain];
+    }
+}
+
+- (void)meterTimerDone:(NSTimer *)timer {
+    CFIndex itemCount;
+    const void **items;
+    CFIndex itemIndex;
+    PhotoGallerySyncItem *item;
+
+    assert(timer == self->_meterTimer);
+    #pragma unused(timer)
+
+    itemCount = CFDictionaryGetCount(self->_runningOperationToItemMap);
+    if (itemCount != 0) {
+        items = malloc(itemCount * sizeof(*items));
+        assert(items != NULL);
+        CFDictionaryGetKeysAndValues(self->_runningOperationToItemMap,
+                                     NULL, items);
+        for (itemIndex = 0; itemIndex < itemCount; itemIndex++) {
+            item = (PhotoGallerySyncItem *) items[itemIndex];
+            if (item->_queue == kPhotoGallerySyncQueueNetwork) {
+                [self meterItem:item];
+            }
+        }
+        free(items);
+    }
+
+    if (self->_runningOperationCount[kPhotoGallerySyncQueueNetwork] == 0) {
+        [self->_meterTimer invalidate];
+        [self->_meterTimer release];
+        self->_meterTimer = nil;
+    }
+
+    // Metering may have put a lane into debt, in which case the quota timer
+    // needs to know when it will be out again.
+    [self pumpQueue:kPhotoGallerySyncQueueNetwork];
+}
+
+#pragma mark * Completion
+
+/*
+ * Called by NetworkManager on the main thread when a lane operation
+ * completes without being cancelled.
+ */
+- (void)operationDone:(NSOperation *)operation {
+    PhotoGallerySyncItem *item;
+    PhotoGallerySyncLane *lane;
+    BOOL failed;
+
+    assert([NSThread isMainThread]);
+    assert(operation != nil);
+
+    item = (PhotoGallerySyncItem *)
+    CFDictionaryGetValue(self->_runningOperationToItemMap, operation);
+    assert(item != nil);
+    [[item retain] autorelease];
+    lane = item->_lane;
+
+    lane.totalRunTime += [NSDate timeIntervalSinceReferenceDate] -
+                         item->_startTime;
+    failed = [operation respondsToSelector:@selector(error)] &&
+             ([(id)operation error] != nil);
+    if (failed) {
+        lane.failedCount += 1;
+    } else {
+        lane.completedCount += 1;
+    }
+    if (item->_queue == kPhotoGallerySyncQueueNetwork) {
+        // The lane's next reservations are sized from what its finished
+        // operations received, failed attempts and all.
+        [self meterItem:item];
+        lane->_finishedNetworkOperationCount += 1;
+        lane->_finishedNetworkByteCount += item->_chargedBytes;
+    }
+    [self removeRunningItem:item];
+
+    [item->_target performSelector:item->_action withObject:operation];
+
+    // The completion may have queued more work or cancelled some; either
+    // way there may now be room to start something.
+    [self pumpQueue:item->_queue];
+}
+
+@end
@@ -21,6 +21,7 @@
     NSURLRequest * _lastRequest;
     NSHTTPURLResponse * _lastResponse;
     NSData * _responseBody;
+    volatile int64_t _receivedByteCount;
     
 #if ! defined (NDEBUG)
     NSError * _debugError;
@@ -53,6 +54,13 @@ authenticationDelegate;
 @property (copy, readonly) NSHTTPURLResponse *lastResponse;
 @property (copy, readonly) NSData *responseBody;
 
+/*
+ * Response bytes received so far, whether they went to responseBody or to 
+ * responseOutputStream. Can be read from any thread while the operation 
+ * runs.
+ */
+@property (assign, readonly) unsigned long long receivedByteCount;
+
 @end
 
 
@@ -134,7 +134,7 @@
         if (v != self->_acceptableContentTypes) {
             [self willChangeValueForKey:@"acceptableContentTypes"];
             [self->_acceptableContentTypes autorelease];
-            self->_acceptableContentTypes = v;
+            self->_acceptableContentTypes = [v copy];
             [self didChangeValueForKey:@"acceptableContentTypes"];
         }
     }
@@ -214,6 +214,12 @@
 @synthesize firstData = _firstData;
 @synthesize dataAccumulator = _dataAccumulator;
 
+- (unsigned long long)receivedByteCount {
+    // a plain 64-bit load isn't atomic on 32-bit ARM
+    return (unsigned long long)
+           __sync_add_and_fetch(&self->_receivedByteCount, 0);
+}
+
 - (NSURL *)URL {
     return [self.request URL];
 }
@@ -263,11 +269,11 @@
     }
 #endif
 
-    assert(self.connection != nil);
-    self.connection = [[NSURLConnection alloc] 
-                       initWithRequest:self.request 
-                       delegate:self 
-                       startImmediately:NO];
+    assert(self.connection == nil);
+    self.connection = [[[NSURLConnection alloc] 
+                        initWithRequest:self.request 
+                        delegate:self 
+                        startImmediately:NO] autorelease];
     assert(self.connection != nil);
     
     for (NSString * mode in self.actualRunLoopModes) {
@@ -307,7 +313,7 @@
             self.debugDelayTimer = 
             [NSTimer timerWithTimeInterval:self.debugDelay
                                     target:self
-                                  selector:@selector(debugDelayTimer) 
+                                  selector:@selector(debugDelayTimerDone:) 
                                   userInfo:error 
                                    repeats:NO];
             assert(self.debugDelayTimer != nil);
@@ -400,6 +406,7 @@ didReceiveResponse:(NSURLResponse *)response {
     assert(self.isActualRunLoopThread);
     assert(connection == self.connection);
     assert(data != nil);
+    __sync_add_and_fetch(&self->_receivedByteCount, (int64_t)[data length]);
     success = YES;
     if (self.firstData) {
         assert(self.dataAccumulator == nil);
@@ -490,6 +497,12 @@ didReceiveResponse:(NSURLResponse *)response {
     assert(connection == self.connection);
     assert(self.lastResponse != nil);
     
+    // Hand the accumulated data (if any) over as the response body.
+    if (self.dataAccumulator != nil) {
+        assert(self->_responseBody == nil);
+        self->_responseBody = [self.dataAccumulator copy];
+        self.dataAccumulator = nil;
+    }
     if (self->_responseBody == nil) {
         self->_responseBody = [[NSData alloc] init];
         assert(self->_responseBody != nil);
@@ -4,16 +4,40 @@
  */
 
 #import "QLog.h"
+#import "QMainThreadPublisher.h"
 
 #include <stdarg.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <xlocale.h>
 #include <time.h>
 #include <sys/time.h>
-#include <mach/mach.h>
-#include <libkern/OSAtomic.h>
+
+// The log entry header uses a few Darwin-only APIs. Elsewhere (for example
+// GNUstep on Linux, where the networking benchmarks run) we substitute the 
+// nearest portable equivalent.
+
+#if defined(__APPLE__)
+    #include <xlocale.h>
+    #include <mach/mach.h>
+    #include <libkern/OSAtomic.h>
+
+    #define QLogStrftime(buf, size, format, tm) \
+        strftime_l(buf, size, format, tm, NULL)
+    #define QLogProgramName()   getprogname()
+    #define QLogThreadID()      ((unsigned int) mach_thread_self())
+#else
+    #include <errno.h>
+    #include <pthread.h>
+
+    #define QLogStrftime(buf, size, format, tm) \
+        strftime(buf, size, format, tm)
+    #define QLogProgramName() \
+        [[[NSProcessInfo processInfo] processName] UTF8String]
+    #define QLogThreadID()      ((unsigned int) (uintptr_t) pthread_self())
+    #define OSAtomicAdd64(amount, valuePtr) \
+        __sync_add_and_fetch(valuePtr, amount)
+#endif
 
 // Enable QLOG_ADD_SEQUENCE_NUMBERS to add sequences numbers to the front of 
 // each log entry. This is a useful tool for debugging various probolems. For 
@@ -64,7 +88,7 @@
         assert(self->_pendingEntries != nil);
         
         self->_enabled = NO;
-        self->_logFile = NO;
+        self->_logFile = -1;
         self->_logFileLength = -1;
         
         [[NSNotificationCenter defaultCenter] 
@@ -145,6 +169,7 @@
             if (self->_logFile != -1) {
                 junk = fstat(self->_logFile, &sb);
                 assert(junk == 0);
+                #pragma unused(junk)
                 newLength = sb.st_size;
                 assert(newLength >= 0);
             }
@@ -153,7 +178,8 @@
             // log file.
             assert(self->_logFile != -1);
             junk = close(self->_logFile);
-            assert(junk == -1);
+            assert(junk == 0);
+            #pragma unused(junk)
             self->_logFile = -1;
             newLength = -1;
         }
@@ -245,11 +271,11 @@
             success = localtime_r(&now.tv_sec, &localNow) != NULL;
         }
         if (success) {
-            success = strftime_l(dateTimeStr, sizeof(dateTimeStr), 
-                                 "%Y-%m-%d %H:%M:%S", &localNow, NULL) != 0;
+            success = QLogStrftime(dateTimeStr, sizeof(dateTimeStr), 
+                                   "%Y-%m-%d %H:%M:%S", &localNow) != 0;
         }
         if (!success) {
-            strlcpy(dateTimeStr, "?", sizeof(dateTimeStr));
+            snprintf(dateTimeStr, sizeof(dateTimeStr), "?");
         }
         
         #if QLOG_ADD_SEQUENCE_NUMBERS
@@ -267,20 +293,23 @@
                     sequenceNumberStr, 
                     dateTimeStr, 
                     (int)(now.tv_usec / 1000),
-                    getprogname(),
+                    QLogProgramName(),
                     (int)getpid(),
-                    (unsigned int)mach_thread_self(),
+                    QLogThreadID(),
                     formattedArgs];
         assert(newEntry != nil);
         
         // Add the log entry to the list of new entries and, if this is the 
-        // first element in the list. tell the main thread about it.
+        // first element in the list. tell the main thread about it. The 
+        // flush rides along with whatever else is being published to the 
+        // main thread.
         @synchronized(self) {
             [self->_pendingEntries addObject:newEntry];
             if ([self->_pendingEntries count] == 1) {
-                [self performSelectorOnMainThread:@selector(flush)
-                                       withObject:nil
-                                    waitUntilDone:NO];
+                [[QMainThreadPublisher sharedPublisher] 
+                 publishToTarget:self 
+                          action:@selector(flush) 
+                      withObject:nil];
             }
         }
         
@@ -427,6 +456,7 @@
             
             junk = fstat(self->_logFile, &sb);
             assert(junk == 0);
+            #pragma unused(junk)
             
             self->_logFileLength = sb.st_size;
             assert(self->_logFileLength >= 0);
@@ -442,6 +472,7 @@
         int junk;
         junk = ftruncate(self->_logFile, 0);
         assert(junk == 0);
+        #pragma unused(junk)
         self->_logFileLength = 0;
     }
     
@@ -0,0 +1,75 @@
+/*
+ * File: QMainThreadPublisher.h
+ * Contains: Coalesces state publication from background threads onto the 
+ * main thread.
+ */
+
+#import <Foundation/Foundation.h>
+
+// Background code often needs to tell the main thread that something changed
+// (a KVO-visible state, a completion, a log flush). Doing that with one 
+// -performSelectorOnMainThread:... per change means that, with thousands of 
+// operations in flight, the main thread's run loop spends its time working 
+// through a backlog of tiny messages.
+//
+// QMainThreadPublisher replaces that with a shared channel:
+// 1. -publishToTarget:action:withObject: can be called on any thread and 
+// takes no locks. It marks the (target, action, object) triple dirty in a 
+// fixed-size, lock-free table. If the triple is already dirty the call does
+// nothing else: no allocation, no retain and no main thread work.
+// 2. A newly dirty triple is pushed onto a lock-free list. Only the push 
+// that finds the list empty sends a message to the main thread, so there's
+// at most one drain message outstanding per batch.
+// 3. The main thread takes the whole list in one go and, in the order the 
+// triples were marked, marks each clean and calls [target action:object]. A
+// target that publishes the same triple several times before a drain is 
+// therefore called once, so actions should sync from current state rather 
+// than assume one call per change. A publication made while its action is 
+// running marks the triple dirty again.
+// 4. Targets and objects are retained until their action has been called.
+//
+// Deduplication is best effort. Two threads publishing the same new triple 
+// at the same instant, or a table neighbourhood that is full, can result in
+// a triple being delivered twice in one drain, which point 3 already 
+// allows for.
+
+@interface QMainThreadPublisher : NSObject {
+    // any thread, updated with atomic operations.
+    void *_slots;
+    void * volatile _dirtyHead;
+    
+    // main thread write, any thread read.
+    BOOL _coalescing;
+    
+    // any thread, updated atomically.
+    volatile int64_t _publishCount;
+    volatile int64_t _mainThreadMessageCount;
+    
+    // main thread only.
+    NSUInteger _deliveryCount;
+}
+
+// Returns the singleton publisher. Can be called from any thread.
++ (QMainThreadPublisher *)sharedPublisher;
+
+// Arranges for [target action:object] to be called on the main thread on the
+// next drain. action takes zero or one argument; object may be nil. Can be 
+// called from any thread, including the main thread.
+- (void)publishToTarget:(id)target action:(SEL)action withObject:(id)object;
+
+// YES by default. Setting it to NO makes each publication a plain 
+// -performSelectorOnMainThread:... on the target, with no deduplication. 
+// That's how things worked before this class existed; it's here so that 
+// benchmarks can compare the two. Set it before publishing anything.
+@property (assign, readwrite, getter=isCoalescing) BOOL coalescing;
+
+// Statistics, for benchmarks. publishCount and mainThreadMessageCount can be
+// read from any thread; deliveryCount, the number of actions called by 
+// drains, is main thread only. Measure main thread time from the outside 
+// (see NetworkBenchmark), because most of the cost of a message is in the 
+// run loop, not in the drain.
+@property (assign, readonly) unsigned long long publishCount;
+@property (assign, readonly) unsigned long long mainThreadMessageCount;
+@property (assign, readonly) NSUInteger deliveryCount;
+
+@end
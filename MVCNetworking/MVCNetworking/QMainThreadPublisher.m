@@ -0,0 +1,270 @@
+/*
+ * File: QMainThreadPublisher.m
+ * Contains: Coalesces state publication from background threads onto the 
+ * main thread.
+ */
+
+#import "QMainThreadPublisher.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Each dirty triple occupies a QPublication slot in a fixed, open-addressed
+ * table. A slot moves EMPTY -> CLAIMED (a publisher is filling it in) -> 
+ * DIRTY (it's on the dirty list) and back to EMPTY when the main thread 
+ * delivers it. Publishers claim an empty slot with compare-and-swap and 
+ * look for an existing dirty copy of their triple by reading slots without 
+ * locking; the slot's generation, bumped on every claim, tells them whether
+ * the slot was recycled under them while they looked.
+ *
+ * The dirty list is a singly linked stack. Publishers push with 
+ * compare-and-swap; the main thread takes the entire stack with a single 
+ * atomic exchange. Because the consumer never pops individual records 
+ * there's no ABA problem to worry about.
+ *
+ * If every slot in a triple's neighbourhood is in use, the publisher falls
+ * back to a malloc'ed overflow record that goes on the same list, so 
+ * nothing is ever dropped.
+ */
+typedef struct QPublication QPublication;
+
+struct QPublication {
+    QPublication *next;
+    volatile int32_t state;
+    volatile uint32_t generation;
+    BOOL overflow;
+    id target;
+    SEL action;
+    id object;
+};
+
+enum {
+    kQPublicationEmpty,
+    kQPublicationClaimed,
+    kQPublicationDirty
+};
+
+enum {
+    kQPublicationSlotCount = 1024,      // must be a power of two
+    kQPublicationProbeCount = 8
+};
+
+static NSUInteger PublicationHash(id target, SEL action, id object) {
+    uintptr_t hash;
+    hash = (uintptr_t)target ^ 
+           ((uintptr_t)action << 3) ^ 
+           ((uintptr_t)object << 7);
+    hash ^= hash >> 11;
+    return (NSUInteger)hash;
+}
+
+@interface QMainThreadPublisher () 
+
+- (void)pushPublication:(QPublication *)publication;
+- (void)drain;
+
+@end
+
+@implementation QMainThreadPublisher
+
++ (QMainThreadPublisher *)sharedPublisher {
+    static QMainThreadPublisher *sPublisher;
+    
+    // See +[QLog log] for why the unsynchronised preflight is safe.
+    if (sPublisher == nil) {
+        @synchronized([QMainThreadPublisher class]) {
+            if (sPublisher == nil) {
+                sPublisher = [[QMainThreadPublisher alloc] init];
+                assert(sPublisher != nil);
+            }
+        }
+    }
+    return sPublisher;
+}
+
+- (id)init {
+    self = [super init];
+    if (self != nil) {
+        self->_slots = calloc(kQPublicationSlotCount, sizeof(QPublication));
+        assert(self->_slots != NULL);
+        self->_coalescing = YES;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    assert(NO);
+    [super dealloc];
+}
+
+@synthesize coalescing = _coalescing;
+@synthesize deliveryCount = _deliveryCount;
+
+- (unsigned long long)publishCount {
+    return (unsigned long long)self->_publishCount;
+}
+
+- (unsigned long long)mainThreadMessageCount {
+    return (unsigned long long)self->_mainThreadMessageCount;
+}
+
+- (void)publishToTarget:(id)target action:(SEL)action withObject:(id)object {
+    QPublication *slots;
+    QPublication *slot;
+    QPublication *emptySlot;
+    NSUInteger hash;
+    NSUInteger probe;
+    
+    // Can be called on any thread.
+    assert(target != nil);
+    assert(action != nil);
+    
+    __sync_add_and_fetch(&self->_publishCount, 1);
+    
+    if (!self->_coalescing) {
+        __sync_add_and_fetch(&self->_mainThreadMessageCount, 1);
+        [target performSelectorOnMainThread:action 
+                                 withObject:object 
+                              waitUntilDone:NO];
+        return;
+    }
+    
+    // Look through the triple's neighbourhood for a dirty copy of it, 
+    // remembering the first empty slot in case there isn't one.
+    slots = (QPublication *)self->_slots;
+    hash = PublicationHash(target, action, object);
+    emptySlot = NULL;
+    for (probe = 0; probe < kQPublicationProbeCount; probe++) {
+        uint32_t generation;
+        BOOL matches;
+        
+        slot = &slots[(hash + probe) & (kQPublicationSlotCount - 1)];
+        generation = slot->generation;
+        __sync_synchronize();
+        if (slot->state == kQPublicationDirty) {
+            matches = (slot->target == target) && 
+                      (slot->action == action) && 
+                      (slot->object == object);
+            __sync_synchronize();
+            if (matches && 
+                (slot->state == kQPublicationDirty) && 
+                (slot->generation == generation)) {
+                // Already dirty; the pending drain will pick it up.
+                return;
+            }
+        } else if ((emptySlot == NULL) && 
+                   (slot->state == kQPublicationEmpty)) {
+            emptySlot = slot;
+        }
+    }
+    
+    // Claim a slot. Someone else may get to the empty one first, in which 
+    // case try the rest of the neighbourhood before giving up on the table.
+    slot = NULL;
+    if ((emptySlot != NULL) && 
+        __sync_bool_compare_and_swap(&emptySlot->state, 
+                                     kQPublicationEmpty, 
+                                     kQPublicationClaimed)) {
+        slot = emptySlot;
+    } else {
+        for (probe = 0; probe < kQPublicationProbeCount; probe++) {
+            QPublication *candidate;
+            candidate = &slots[(hash + probe) & (kQPublicationSlotCount - 1)];
+            if (__sync_bool_compare_and_swap(&candidate->state, 
+                                             kQPublicationEmpty, 
+                                             kQPublicationClaimed)) {
+                slot = candidate;
+                break;
+            }
+        }
+    }
+    if (slot != NULL) {
+        __sync_add_and_fetch(&slot->generation, 1);
+        slot->overflow = NO;
+    } else {
+        slot = calloc(1, sizeof(*slot));
+        assert(slot != NULL);
+        slot->overflow = YES;
+    }
+    slot->target = [target retain];
+    slot->action = action;
+    slot->object = [object retain];
+    __sync_synchronize();
+    slot->state = kQPublicationDirty;
+    
+    [self pushPublication:slot];
+}
+
+- (void)pushPublication:(QPublication *)publication {
+    QPublication *oldHead;
+    
+    do {
+        oldHead = (QPublication *)self->_dirtyHead;
+        publication->next = oldHead;
+    } while (!__sync_bool_compare_and_swap(&self->_dirtyHead, 
+                                           oldHead, 
+                                           publication));
+    
+    // If the list was empty, the main thread doesn't know about this batch 
+    // yet, so tell it. Everything pushed before that message is handled 
+    // goes out in the same drain.
+    if (oldHead == NULL) {
+        __sync_add_and_fetch(&self->_mainThreadMessageCount, 1);
+        [self performSelectorOnMainThread:@selector(drain)
+                               withObject:nil
+                            waitUntilDone:NO];
+    }
+}
+
+- (void)drain {
+    QPublication *publication;
+    QPublication *reversed;
+    
+    assert([NSThread isMainThread]);
+    
+    // Take everything that's dirty. Publications that arrive while we're 
+    // delivering start a new batch (and a new drain message).
+    publication = __sync_lock_test_and_set(&self->_dirtyHead, NULL);
+    
+    // The list is newest first; deliver in the order things were published.
+    reversed = NULL;
+    while (publication != NULL) {
+        QPublication *next;
+        next = publication->next;
+        publication->next = reversed;
+        reversed = publication;
+        publication = next;
+    }
+    
+    while (reversed != NULL) {
+        id target;
+        SEL action;
+        id object;
+        
+        publication = reversed;
+        reversed = publication->next;
+        
+        // Mark the slot clean before calling out, so that a publication made
+        // by, or during, the action is delivered in a later drain. The 
+        // references the slot held are ours to release now.
+        target = publication->target;
+        action = publication->action;
+        object = publication->object;
+        if (publication->overflow) {
+            free(publication);
+        } else {
+            publication->target = nil;
+            publication->object = nil;
+            __sync_synchronize();
+            publication->state = kQPublicationEmpty;
+        }
+        
+        [target performSelector:action withObject:object];
+        self->_deliveryCount += 1;
+        [target release];
+        [object release];
+    }
+}
+
+@end
@@ -24,14 +24,21 @@ typedef enum QRunLoopOperationState QRunLoopOperationState;
 // that bad things will happen if you do.
 
 
-@property (nonatomic, readwrite) NSThread *runLoopThread;
-@property (nonatomic, readwrite) NSSet *runLoopModes;
+@property (retain, readwrite) NSThread *runLoopThread;
+@property (copy, readwrite) NSSet *runLoopModes;
 @property (copy, readonly) NSError *error;
 @property (assign, readonly) QRunLoopOperationState state;
 @property (retain, readonly) NSThread *actualRunLoopThread;
 @property (assign, readonly) BOOL isActualRunLoopThread;
 @property (copy, readonly) NSSet *actualRunLoopModes;
 
+// Cancels a batch of operations without blocking. Unlike -cancel, which 
+// waits for a round trip to the operation's run loop thread, this marks each
+// operation cancelled straight away and then finishes them all with one 
+// message per run loop thread. Operations that aren't QRunLoopOperations 
+// just get -cancel. Can be called from any thread.
++ (void)cancelOperations:(NSArray *)operations;
+
 @end
 
 @interface QRunLoopOperation (SubClassSupport) 
@@ -217,7 +217,9 @@
                     modes:[self.actualRunLoopModes allObjects]];
 }
 
-- (void)cancel {
+// Marks the operation as cancelled. Returns YES if the caller must then
+// arrange for -cancelOnRunLoopThread to run on the run loop thread.
+- (BOOL)markCancelled {
     BOOL runCancelOnRunLoopThread;
     BOOL oldValue;
     @synchronized(self) {
@@ -226,7 +228,11 @@
         runCancelOnRunLoopThread = !oldValue && 
         self.state == kQRunLoopOperationStateExecuting;
     }
-    if (runCancelOnRunLoopThread) {
+    return runCancelOnRunLoopThread;
+}
+
+- (void)cancel {
+    if ([self markCancelled]) {
         [self performSelector:@selector(cancelOnRunLoopThread)
                      onThread:self.actualRunLoopThread
                    withObject:nil
@@ -234,4 +240,52 @@
                         modes:[self.actualRunLoopModes allObjects]];
     }
 }
+
++ (void)cancelOperations:(NSArray *)operations {
+    NSMutableDictionary *batches;
+    
+    // Operations are batched by run loop thread and modes, so that each 
+    // batch's cancellation runs in exactly the modes its operations asked
+    // for.
+    batches = [NSMutableDictionary dictionary];
+    assert(batches != nil);
+    
+    for (NSOperation *operation in operations) {
+        if (![operation isKindOfClass:[QRunLoopOperation class]]) {
+            [operation cancel];
+        } else if ([(QRunLoopOperation *)operation markCancelled]) {
+            QRunLoopOperation *runLoopOperation;
+            NSArray *batchKey;
+            NSMutableArray *batch;
+            
+            runLoopOperation = (QRunLoopOperation *)operation;
+            batchKey = [NSArray arrayWithObjects:
+                        runLoopOperation.actualRunLoopThread, 
+                        runLoopOperation.actualRunLoopModes, 
+                        nil];
+            batch = [batches objectForKey:batchKey];
+            if (batch == nil) {
+                batch = [NSMutableArray array];
+                [batches setObject:batch forKey:batchKey];
+            }
+            [batch addObject:runLoopOperation];
+        }
+    }
+    
+    for (NSArray *batchKey in batches) {
+        [self performSelector:@selector(cancelOperationsOnRunLoopThread:) 
+                     onThread:[batchKey objectAtIndex:0]
+                   withObject:[batches objectForKey:batchKey]
+                waitUntilDone:NO
+                        modes:[[batchKey objectAtIndex:1] allObjects]];
+    }
+}
+
++ (void)cancelOperationsOnRunLoopThread:(NSArray *)operations {
+    for (QRunLoopOperation *operation in operations) {
+        assert(operation.isActualRunLoopThread);
+        [operation cancelOnRunLoopThread];
+    }
+}
+
 @end
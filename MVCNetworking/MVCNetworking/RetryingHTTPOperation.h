@@ -26,6 +26,7 @@ typedef enum RetryingHTTPOperationState RetryingHTTPOperationState;
     NSUInteger _sequenceNumber;
     NSURLRequest * _request;
     NSSet * _acceptableContentTypes;
+    NSArray * _retryDelays;
     
     NSString * _responseFilePath;
     NSHTTPURLResponse * _response;
@@ -39,6 +40,7 @@ typedef enum RetryingHTTPOperationState RetryingHTTPOperationState;
     BOOL _hasHadRetryableFailure;
     
     NSUInteger _retryCount;
+    volatile int64_t _finishedAttemptsByteCount;
     NSTimer * _retryTimer;
     QReachabilityOperation * _reachabilityOperation;
     BOOL _notificationInstalled;
@@ -51,11 +53,27 @@ typedef enum RetryingHTTPOperationState RetryingHTTPOperationState;
 
 @property (copy, readonly) NSURLRequest *request;
 @property (copy, readwrite) NSSet *acceptableContentTypes;
+
+/*
+ * The back-off schedule, as NSNumbers of seconds; the last one repeats. nil, 
+ * the default, means a second, a minute and then an hour. Tests and 
+ * benchmarks set a short schedule so that they don't stall. Set it before 
+ * the operation starts.
+ */
+@property (copy, readwrite) NSArray *retryDelays;
 @property (retain, readwrite) NSString *responseFilePath;
 @property (assign, readonly) RetryingHTTPOperationState retryState;
 @property (assign, readonly) RetryingHTTPOperationState retryStateClient;
 @property (assign, readonly) BOOL hasHadRetryableFailure;
 @property (assign, readonly) NSUInteger retryCount;
+
+/*
+ * Response bytes received so far over every attempt, failed and cancelled
+ * ones included, whether or not the response goes to responseFilePath. Can 
+ * be read from any thread. It can briefly dip while an attempt is handed 
+ * over, so callers metering it should keep the largest value seen.
+ */
+@property (assign, readonly) unsigned long long receivedByteCount;
 @property (copy, readonly) NSString *responseMIMEType;
 @property (copy, readonly) NSData *responseContent;
 
@@ -2,7 +2,15 @@
 #import "NetworkManager.h"
 #import "logging.h"
 #import "QHTTPOperation.h"
-#import "QReachabilityOperation.h"
+#import "QMainThreadPublisher.h"
+
+/*
+ * SystemConfiguration only exists on Apple platforms. Elsewhere (for example
+ * GNUstep on Linux) we retry on the timer and the success notification alone.
+ */
+#if TARGET_OS_MAC
+    #import "QReachabilityOperation.h"
+#endif
 
 /*
  * When one operation completes it posts the following notification. Other 
@@ -30,7 +38,10 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
 @property (assign, readwrite) BOOL notificationInstalled;
 
 - (void)startRequest;
+- (void)dropNetworkOperation;
+#if TARGET_OS_MAC
 - (void)startReachabilityReachable:(BOOL)reachable;
+#endif
 - (void)startRetryAfterTimeInterval:(NSTimeInterval)delay;
 
 @end
@@ -70,6 +81,7 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
 - (void)dealloc {
     [self->_request release];
     [self->_acceptableContentTypes release];
+    [self->_retryDelays release];
     [self->_responseFilePath release];
     [self->_response release];
     [self->_responseContent release];
@@ -92,21 +104,29 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
     assert([self isActualRunLoopThread]);
     assert(v != self->_retryState);
     self->_retryState = v;
-    [self performSelectorOnMainThread:@selector(syncRetryStateClient) 
-                           withObject:nil 
-                        waitUntilDone:NO];
     
+    // Several transitions can happen before the main thread catches up; 
+    // the publisher collapses them into one -syncRetryStateClient.
+    [[QMainThreadPublisher sharedPublisher] 
+     publishToTarget:self 
+              action:@selector(syncRetryStateClient) 
+          withObject:nil];
 }
 
-@synthesize retryStateClient = retryStateClient;
+@synthesize retryStateClient = _retryStateClient;
 
 - (void)syncRetryStateClient {
+    RetryingHTTPOperationState newState;
     assert([NSThread isMainThread]);
-    self.retryStateClient = self.retryState;
+    newState = self.retryState;
+    if (newState != self.retryStateClient) {
+        self.retryStateClient = newState;
+    }
 }
 
 @synthesize hasHadRetryableFailure = _hasHadRetryableFailure;
 @synthesize acceptableContentTypes = _acceptableContentTypes;
+@synthesize retryDelays = _retryDelays;
 @synthesize responseFilePath = _responseFilePath;
 @synthesize response = _response;
 @synthesize networkOperation = _networkOperation;
@@ -115,6 +135,37 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
 @synthesize reachabilityOperation = _reachabilityOperation;
 @synthesize notificationInstalled = _notificationInstalled;
 
+- (unsigned long long)receivedByteCount {
+    QHTTPOperation *networkOperation;
+    unsigned long long result;
+    
+    // Read the finished total before the current attempt; see 
+    // -dropNetworkOperation for why. networkOperation is atomic, so we get a 
+    // reference that stays valid even if the attempt is dropped meanwhile.
+    result = (unsigned long long)
+             __sync_add_and_fetch(&self->_finishedAttemptsByteCount, 0);
+    networkOperation = self.networkOperation;
+    if (networkOperation != nil) {
+        result += networkOperation.receivedByteCount;
+    }
+    return result;
+}
+
+/*
+ * Drops the current attempt, folding its byte count into the total. The 
+ * attempt is dropped before its bytes are added, so that a reader on 
+ * another thread can undercount for a moment but never count twice.
+ */
+- (void)dropNetworkOperation {
+    QHTTPOperation *networkOperation;
+    
+    networkOperation = [[self.networkOperation retain] autorelease];
+    assert(networkOperation != nil);
+    self.networkOperation = nil;
+    __sync_add_and_fetch(&self->_finishedAttemptsByteCount, 
+                         (int64_t)networkOperation.receivedByteCount);
+}
+
 - (NSString *)responseMIMEType {
     NSString *result;
     NSHTTPURLResponse *aResponse;
@@ -130,10 +181,51 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
 
 #pragma mark * Utilities
 
-- (void)setHashadRetryableFailureOnMainThread {
+- (void)setHasHadRetryableFailureOnMainThread {
     assert([NSThread isMainThread]);
-    assert(!self.hasHadRetryableFailure);
-    self.hasHadRetryableFailure = YES;
+    // A fast retry can fail again before the main thread gets to the first
+    // of these, so tolerate being called twice.
+    if (!self.hasHadRetryableFailure) {
+        self.hasHadRetryableFailure = YES;
+    }
+}
+
+/*
+ * Returns the delay before the next retry. By default we back off quickly (a
+ * second, a minute, an hour); retryDelays overrides that. Either way we add 
+ * up to 10% of random jitter so that a crowd of operations that failed 
+ * together doesn't retry together.
+ */
+- (NSTimeInterval)retryDelay {
+    static const NSTimeInterval kRetryDelays[] = { 1.0, 60.0, 60.0 * 60.0 };
+    NSArray *retryDelays;
+    NSUInteger delayIndex;
+    NSTimeInterval delay;
+    
+    delayIndex = self.retryCount;
+    retryDelays = self.retryDelays;
+    if ([retryDelays count] != 0) {
+        if (delayIndex >= [retryDelays count]) {
+            delayIndex = [retryDelays count] - 1;
+        }
+        delay = [[retryDelays objectAtIndex:delayIndex] doubleValue];
+    } else {
+        if (delayIndex >= (sizeof(kRetryDelays) / sizeof(kRetryDelays[0]))) {
+            delayIndex = (sizeof(kRetryDelays) / sizeof(kRetryDelays[0])) - 1;
+        }
+        delay = kRetryDelays[delayIndex];
+    }
+    return delay + (delay * 0.1 * ((double)(random() % 1000) / 1000.0));
+}
+
+/*
+ * Returns the delay used when we have reason to believe that a retry will 
+ * succeed, that is, when the host has become reachable or another transfer
+ * to the same host has succeeded. This is random so that all of the waiting
+ * operations don't hit the server at the same instant.
+ */
+- (NSTimeInterval)shortRetryDelay {
+    return ((double)(random() % 1000) / 1000.0);
 }
 
 /*
@@ -154,6 +246,10 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
                     shouldRetry = NO;
                 }
                 break;
+                default: {
+                    shouldRetry = YES;
+                }
+                break;
             }
         }
     } else {
@@ -208,7 +304,239 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
      action:@selector(networkOperationDone:)];
 }
 
+/*
+ * Called when the network operation finishes. We look at the result to 
+ * decide whether to finish, or to wait and then retry.
+ */
 - (void)networkOperationDone:(QHTTPOperation *)operation {
+    NSError *error;
+    assert([self isActualRunLoopThread]);
+    assert(operation == self.networkOperation);
+    assert((self.retryState == kRetryingHTTPOperationStateGetting) || 
+           (self.retryState == kRetryingHTTPOperationStateRetrying));
+    
+    error = operation.error;
+    self.response = operation.lastResponse;
+    if (self.responseFilePath == nil) {
+        self.responseContent = operation.responseBody;
+    }
+    [self dropNetworkOperation];
+    
+    if (error == nil) {
+        [[QLog log] logOption:kLogOptionNetworkDetails 
+                   withFormat:@"http %zu request success", 
+                              (size_t)self->_sequenceNumber];
+        
+        // Tell everyone else waiting on this host that now is a good time 
+        // to retry.
+        [[NSNotificationCenter defaultCenter] 
+         postNotificationName:kRetryingHTTPOperationTransferDidSucceedNotifcation
+                       object:nil 
+                     userInfo:[NSDictionary 
+                               dictionaryWithObject:[[self.request URL] host]
+                                   forKey:kRetryingHTTPOperationTransferDidSucceedHostKey]];
+        [self finishWithError:nil];
+    } else if ([self shouldRetryAfterError:error]) {
+        [[QLog log] logOption:kLogOptionNetworkDetails 
+                   withFormat:@"http %zu request error %@", 
+                              (size_t)self->_sequenceNumber, error];
+        
+        if (!self.hasHadRetryableFailure) {
+            [[QMainThreadPublisher sharedPublisher] 
+             publishToTarget:self 
+                      action:@selector(setHasHadRetryableFailureOnMainThread) 
+                  withObject:nil];
+        }
+        
+        if (!self.notificationInstalled) {
+            [[NSNotificationCenter defaultCenter] 
+             addObserver:self 
+                selector:@selector(transferDidSucceed:) 
+                    name:kRetryingHTTPOperationTransferDidSucceedNotifcation 
+                  object:nil];
+            self.notificationInstalled = YES;
+        }
+        
+#if TARGET_OS_MAC
+        // Wait for the host to become unreachable; when that happens we 
+        // then wait for it to come back, at which point we retry quickly.
+        if (self.reachabilityOperation == nil) {
+            [self startReachabilityReachable:NO];
+        }
+#endif
+        
+        [self startRetryAfterTimeInterval:[self retryDelay]];
+    } else {
+        [[QLog log] logOption:kLogOptionNetworkDetails 
+                   withFormat:@"http %zu request fatal error %@", 
+                              (size_t)self->_sequenceNumber, error];
+        [self finishWithError:error];
+    }
+}
+
+/*
+ * Schedules the retry timer, replacing any timer that's already running.
+ */
+- (void)startRetryAfterTimeInterval:(NSTimeInterval)delay {
+    assert([self isActualRunLoopThread]);
+    assert(self.networkOperation == nil);
     
+    if (self.retryTimer != nil) {
+        [self.retryTimer invalidate];
+        self.retryTimer = nil;
+    }
+    if (self.retryState != kRetryingHTTPOperationStateWaitingToRetry) {
+        self.retryState = kRetryingHTTPOperationStateWaitingToRetry;
+    }
+    
+    [[QLog log] logOption:kLogOptionNetworkDetails 
+               withFormat:@"http %zu retry wait %.1f", 
+                          (size_t)self->_sequenceNumber, delay];
+    
+    self.retryTimer = [NSTimer timerWithTimeInterval:delay 
+                                              target:self 
+                                            selector:@selector(retryTimerDone:)
+                                            userInfo:nil 
+                                             repeats:NO];
+    assert(self.retryTimer != nil);
+    for (NSString * mode in self.actualRunLoopModes) {
+        [[NSRunLoop currentRunLoop] addTimer:self.retryTimer forMode:mode];
+    }
 }
+
+- (void)retryTimerDone:(NSTimer *)timer {
+    assert([self isActualRunLoopThread]);
+    assert(timer == self.retryTimer);
+    #pragma unused(timer)
+    
+    [self.retryTimer invalidate];
+    self.retryTimer = nil;
+    
+    assert(self.retryState == kRetryingHTTPOperationStateWaitingToRetry);
+    self.retryCount += 1;
+    self.retryState = kRetryingHTTPOperationStateRetrying;
+    [self startRequest];
+}
+
+/*
+ * Called, on any thread, when some other RetryingHTTPOperation succeeds.
+ * If it was talking to our host, we expedite our retry.
+ */
+- (void)transferDidSucceed:(NSNotification *)note {
+    NSString *hostName;
+    hostName = [[note userInfo] 
+                objectForKey:kRetryingHTTPOperationTransferDidSucceedHostKey];
+    if ((hostName != nil) && 
+        [hostName caseInsensitiveCompare:[[self.request URL] host]] == 
+        NSOrderedSame) {
+        [self performSelector:@selector(transferDidSucceedOnRunLoopThread) 
+                     onThread:self.actualRunLoopThread 
+                   withObject:nil 
+                waitUntilDone:NO 
+                        modes:[self.actualRunLoopModes allObjects]];
+    }
+}
+
+- (void)transferDidSucceedOnRunLoopThread {
+    assert([self isActualRunLoopThread]);
+    
+    // We may have started the retry, or even finished, by the time we get 
+    // here, in which case there's nothing to expedite.
+    if ((self.state == kQRunLoopOperationStateExecuting) && 
+        (self.retryState == kRetryingHTTPOperationStateWaitingToRetry)) {
+        [self startRetryAfterTimeInterval:[self shortRetryDelay]];
+    }
+}
+
+#if TARGET_OS_MAC
+
+/*
+ * Starts a reachability operation that finishes when the host becomes 
+ * reachable (reachable is YES) or unreachable (reachable is NO).
+ */
+- (void)startReachabilityReachable:(BOOL)reachable {
+    assert([self isActualRunLoopThread]);
+    assert(self.reachabilityOperation == nil);
+    
+    self.reachabilityOperation = [[[QReachabilityOperation alloc] 
+                                   initWithHostName:[[self.request URL] host]] 
+                                  autorelease];
+    assert(self.reachabilityOperation != nil);
+    
+    if (!reachable) {
+        self.reachabilityOperation.flagsTargetMask = 
+        kSCNetworkReachabilityFlagsReachable;
+        self.reachabilityOperation.flagsTargetValue = 0;
+    }
+    self.reachabilityOperation.runLoopThread = self.runLoopThread;
+    self.reachabilityOperation.runLoopModes = self.runLoopModes;
+    
+    [[NetworkManager shardManager] 
+     addNetworkManagementOperation:self.reachabilityOperation 
+     finishedTarget:self 
+     action:@selector(reachabilityOperationDone:)];
+}
+
+- (void)reachabilityOperationDone:(QReachabilityOperation *)operation {
+    assert([self isActualRunLoopThread]);
+    assert(operation == self.reachabilityOperation);
+    assert(operation.error == nil);
+    
+    self.reachabilityOperation = nil;
+    
+    if ((operation.flags & kSCNetworkReachabilityFlagsReachable) == 0) {
+        // The host went away; wait for it to come back.
+        [self startReachabilityReachable:YES];
+    } else if (self.retryState == kRetryingHTTPOperationStateWaitingToRetry) {
+        // The host is back; a retry is likely to work, so do it now.
+        [self startRetryAfterTimeInterval:[self shortRetryDelay]];
+    }
+}
+
+#endif
+
+/*
+ * Called by QRunLoopOperation when the operation finishes. We tear down 
+ * whatever is still in flight.
+ */
+- (void)operationWillFinish {
+    assert([self isActualRunLoopThread]);
+    [super operationWillFinish];
+    
+    if (self.networkOperation != nil) {
+        [[NetworkManager shardManager] cancelOperation:self.networkOperation];
+        [self dropNetworkOperation];
+    }
+    if (self.retryTimer != nil) {
+        [self.retryTimer invalidate];
+        self.retryTimer = nil;
+    }
+#if TARGET_OS_MAC
+    if (self.reachabilityOperation != nil) {
+        [[NetworkManager shardManager] 
+         cancelOperation:self.reachabilityOperation];
+        self.reachabilityOperation = nil;
+    }
+#endif
+    if (self.notificationInstalled) {
+        [[NSNotificationCenter defaultCenter] 
+         removeObserver:self 
+                   name:kRetryingHTTPOperationTransferDidSucceedNotifcation 
+                 object:nil];
+        self.notificationInstalled = NO;
+    }
+    
+    self.retryState = kRetryingHTTPOperationStateFinished;
+    
+    if (self.error == nil) {
+        [[QLog log] logOption:kLogOptionSyncDetails 
+                   withFormat:@"http %zu success", 
+                              (size_t)self->_sequenceNumber];
+    } else {
+        [[QLog log] logOption:kLogOptionSyncDetails 
+                   withFormat:@"http %zu error %@", 
+                              (size_t)self->_sequenceNumber, self.error];
+    }
+}
+
 @end
@@ -1,12 +1,40 @@
 #import "XMLDocument.h"
 
+/* A query match that is waiting for its end tag so that it can be delivered
+ with the text it contains. */
+@interface XMLQueryCapture : NSObject {
+@public
+  XMLQuery *query;
+  NSString *elementName;
+  NSDictionary *attributes;
+  NSMutableString *text;
+  NSUInteger depth;
+}
+@end
+
+@implementation XMLQueryCapture
+
+- (void) dealloc {
+  [query release];
+  [elementName release];
+  [attributes release];
+  [text release];
+  [super dealloc];
+}
+
+@end
+
 @implementation XMLDocument
 
 @synthesize documentPath;
 @synthesize rootElement;
 @synthesize delegate;
-@synthesize connectin;
+@synthesize xmlParser;
+@synthesize currentElement;
+@synthesize connection;
 @synthesize connectionData;
+@synthesize parsingErrorHasHappened;
+@synthesize queries;
 
 - (id) init {
   return ([self initWithDelegate:nil]);
@@ -20,6 +48,22 @@
   return self;
 }
 
+- (BOOL) parseLocalXMLWithPath:(NSString *)paramLocalXMLPath {
+  if ([paramLocalXMLPath length] == 0) {
+    NSLog(@"The local path cannot be nil or empty.");
+    return NO;
+  }
+
+  NSData *localData = [NSData dataWithContentsOfFile:paramLocalXMLPath];
+  if (localData == nil) {
+    NSLog(@"Could not read the local file.");
+    return NO;
+  }
+
+  self.documentPath = paramLocalXMLPath;
+  return [self parseXMLData:localData];
+}
+
 - (BOOL) parseRemoteXMLWithURL:(NSString *)paramRemoteXMLURL {
   BOOL result = NO;
   if ([paramRemoteXMLURL length] == 0) {
@@ -30,7 +74,7 @@
   // escape the URL with percent signs
   paramRemoteXMLURL = 
     [paramRemoteXMLURL 
-      stringByAddingPercentEscapeUsingEncoding:NSUTF8StringEncoding];
+      stringByAddingPercentEscapesUsingEncoding:NSUTF8StringEncoding];
 
   // Make sure our connection hasn't been created before
   self.connection = nil;
@@ -78,16 +122,7 @@
 - (void) connectionDidFinishLoading:(NSURLConnection *)connection {
   // finished downloading, start parsing the downloaded data.
   if (self.connectionData != nil) {
-    NSXMLParser *newParser = [[NSXMLParser alloc] 
-			       initWithData:self.connectionData];
-    self.xmlParser = newParser;
-    [newParser release];
-
-    [self.xmlParser setShouldProcessNamespaces:NO];
-    [self.xmlParser setShouldReportNamespacePrefixes:NO];
-    [self.xmlParser setShouldResolveExternalEntities:NO];
-    [self.xmlParser setDelegate:self];
-    if ([self.xmlParser parse] == YES) {
+    if ([self parseXMLData:self.connectionData] == YES) {
       NSLog(@"Successfully parsed the remote file.");
     } else {
       NSLog(@"Failed to parse the remote file.");
@@ -95,6 +130,195 @@
   }
 }
 
+- (BOOL) parseXMLData:(NSData *)paramXMLData {
+  // Get rid of the tree from the previous parse (if any)
+  self.rootElement = nil;
+  self.currentElement = nil;
+
+  NSXMLParser *newParser = [[NSXMLParser alloc] initWithData:paramXMLData];
+  self.xmlParser = newParser;
+  [newParser release];
+
+  [self.xmlParser setShouldProcessNamespaces:NO];
+  [self.xmlParser setShouldReportNamespacePrefixes:NO];
+  [self.xmlParser setShouldResolveExternalEntities:NO];
+  [self.xmlParser setDelegate:self];
+  return [self.xmlParser parse];
+}
+
+#pragma mark - Queries
+
+- (XMLQuery *) addQueryWithPath:(NSString *)paramPath {
+  XMLQuery *newQuery = [[XMLQuery alloc] initWithPath:paramPath];
+  if (newQuery == nil) {
+    return nil;
+  }
+
+  if (queries == nil) {
+    queries = [[NSMutableArray alloc] init];
+  }
+  [queries addObject:newQuery];
+  [newQuery release];
+
+  // The mask stack is sized by the number of queries, so start it afresh.
+  free(queryMatchMasks);
+  queryMatchMasks = NULL;
+  queryMatchCapacity = 0;
+
+  return newQuery;
+}
+
+- (void) removeAllQueries {
+  [queries release];
+  queries = nil;
+  free(queryMatchMasks);
+  queryMatchMasks = NULL;
+  queryMatchCapacity = 0;
+}
+
+- (void) resetQueryState {
+  queryMatchDepth = 0;
+  skippedDepth = 0;
+  [openQueryCaptures removeAllObjects];
+}
+
+- (void) deliverMatchForQuery:(XMLQuery *)paramQuery
+                  elementName:(NSString *)paramElementName
+                   attributes:(NSDictionary *)paramAttributes
+                         text:(NSString *)paramText {
+  if ([self.delegate respondsToSelector:
+       @selector(xmlDocument:didMatchQuery:elementName:attributes:text:)]) {
+    [self.delegate xmlDocument:self
+                 didMatchQuery:paramQuery
+                   elementName:paramElementName
+                    attributes:paramAttributes
+                          text:paramText];
+  }
+}
+
+- (void) queryDidStartElement:(NSString *)paramElementName
+                   attributes:(NSDictionary *)paramAttributes {
+  /* Inside a subtree that nothing can match we only count tags. This is the
+   common case for large documents, and it doesn't allocate. */
+  if (skippedDepth > 0) {
+    skippedDepth++;
+    return;
+  }
+
+  NSUInteger queryCount = [queries count];
+  NSUInteger queryIndex;
+
+  // Grow the mask stack if we have to.
+  if (queryMatchDepth == queryMatchCapacity) {
+    queryMatchCapacity = (queryMatchCapacity == 0) ? 16 : queryMatchCapacity * 2;
+    queryMatchMasks = realloc(queryMatchMasks, 
+                              queryMatchCapacity * queryCount * 
+                              sizeof(uint32_t));
+  }
+
+  uint32_t *parentMasks = (queryMatchDepth == 0) ? NULL :
+    &queryMatchMasks[(queryMatchDepth - 1) * queryCount];
+  uint32_t *masks = &queryMatchMasks[queryMatchDepth * queryCount];
+  BOOL anyAlive = NO;
+  BOOL anyAnyDepth = NO;
+
+  for (queryIndex = 0; queryIndex < queryCount; queryIndex++) {
+    XMLQuery *query = [queries objectAtIndex:queryIndex];
+    NSArray *querySteps = query->steps;
+    NSUInteger stepCount = [querySteps count];
+    uint32_t parentMask = (parentMasks == NULL) ? 0 : parentMasks[queryIndex];
+    uint32_t mask = 0;
+    NSUInteger stepIndex;
+
+    // Step 0 can match at the root or, for // queries, anywhere.
+    if (query->matchesAtAnyDepth || queryMatchDepth == 0) {
+      if ([[querySteps objectAtIndex:0] matchesElementName:paramElementName
+                                                attributes:paramAttributes]) {
+        mask |= 1;
+      }
+    }
+
+    // Step n can only match if step n - 1 matched our parent.
+    for (stepIndex = 1; stepIndex < stepCount; stepIndex++) {
+      if ((parentMask & (1u << (stepIndex - 1))) != 0 &&
+          [[querySteps objectAtIndex:stepIndex] 
+            matchesElementName:paramElementName
+                    attributes:paramAttributes]) {
+        mask |= (1u << stepIndex);
+      }
+    }
+
+    /* A completed match can't be extended by a descendant, so only the
+     partial matches keep the subtree interesting. */
+    masks[queryIndex] = mask;
+    anyAlive = anyAlive || ((mask & ~(1u << (stepCount - 1))) != 0);
+    anyAnyDepth = anyAnyDepth || query->matchesAtAnyDepth;
+
+    if ((mask & (1u << (stepCount - 1))) != 0) {
+      if (query->capturesText) {
+        XMLQueryCapture *capture = [[XMLQueryCapture alloc] init];
+        capture->query = [query retain];
+        capture->elementName = [paramElementName copy];
+        capture->attributes = [paramAttributes copy];
+        capture->text = [[NSMutableString alloc] init];
+        capture->depth = queryMatchDepth;
+        if (openQueryCaptures == nil) {
+          openQueryCaptures = [[NSMutableArray alloc] init];
+        }
+        [openQueryCaptures addObject:capture];
+        [capture release];
+      } else {
+        [self deliverMatchForQuery:query
+                       elementName:paramElementName
+                        attributes:paramAttributes
+                              text:nil];
+      }
+    }
+  }
+
+  /* If no query can match this element's descendants, and nobody wants its
+   text, skip the whole subtree. */
+  if (anyAlive == NO && anyAnyDepth == NO && 
+      [openQueryCaptures count] == 0) {
+    skippedDepth = 1;
+    return;
+  }
+  queryMatchDepth++;
+}
+
+- (void) queryDidEndElement {
+  if (skippedDepth > 0) {
+    skippedDepth--;
+    return;
+  }
+
+  queryMatchDepth--;
+
+  // Deliver the text captures that this end tag closes.
+  while ([openQueryCaptures count] > 0) {
+    XMLQueryCapture *capture = [openQueryCaptures lastObject];
+    if (capture->depth != queryMatchDepth) {
+      break;
+    }
+    [capture retain];
+    [openQueryCaptures removeLastObject];
+    [self deliverMatchForQuery:capture->query
+                   elementName:capture->elementName
+                    attributes:capture->attributes
+                          text:capture->text];
+    [capture release];
+  }
+}
+
+- (void) queryFoundCharacters:(NSString *)paramString {
+  if (skippedDepth > 0) {
+    return;
+  }
+  for (XMLQueryCapture *capture in openQueryCaptures) {
+    [capture->text appendString:paramString];
+  }
+}
+
 - (void) parser:(NSXMLParser *)parser parseErrorOccurred:(NSError *)parseError {
   NSLog(@"Parsing error has occurred.");
   self.parsingErrorHasHappened = YES;
@@ -115,11 +339,12 @@
 }
 
 - (void) parserDidStartDocument:(NSXMLParser *)parser {
-  self.parsingErrorHasHappend = NO;
+  self.parsingErrorHasHappened = NO;
+  [self resetQueryState];
 }
 
 - (void) parserDidEndDocument:(NSXMLParser *)parser {
-  if (self.parsingErrorHasHappend == NO) {
+  if (self.parsingErrorHasHappened == NO) {
     [self.delegate xmlDocumentDelegateParsingFinished:self];
   }
 }
@@ -130,12 +355,18 @@
 	  qualifiedName:(NSString *)qName
 	     attributes:(NSDictionary *)attributeDict {
 
+  // In query mode we stream; no tree is built.
+  if ([queries count] > 0) {
+    [self queryDidStartElement:elementName attributes:attributeDict];
+    return;
+  }
+
   if (self.rootElement == nil) {
     XMLElement *newElement = [[XMLElement alloc] init];
     self.rootElement = newElement;
     self.currentElement = self.rootElement;
     [newElement release];
-  } eles {
+  } else {
     XMLElement *newElement = [[XMLElement alloc] init];
     newElement.parent = self.currentElement;
     [self.currentElement.children addObject:newElement];
@@ -152,6 +383,11 @@
 
 - (void)         parser:(NSXMLParser *)parser
         foundCharacters:(NSString *)string {
+  if ([queries count] > 0) {
+    [self queryFoundCharacters:string];
+    return;
+  }
+
   if (self.currentElement != nil) {
     if (self.currentElement.text == nil) {
       self.currentElement.text = string;
@@ -166,6 +402,11 @@
         didEndElement:(NSString *)elementName
 	 namespaceURI:(NSString *)namespaceURI
 	qualifiedName:(NSString *)qName {
+  if ([queries count] > 0) {
+    [self queryDidEndElement];
+    return;
+  }
+
   if (self.currentElement != nil) {
     self.currentElement = self.currentElement.parent;
   }
@@ -182,6 +423,9 @@
   [rootElement release];
   [currentElement release];
   [documentPath release];
+  [queries release];
+  [openQueryCaptures release];
+  free(queryMatchMasks);
   [super dealloc];
 }
 
@@ -1,6 +1,7 @@
 #import "XMLElement.h"
 
-@class XMLDocument
+@class XMLDocument;
+@class XMLQuery;
 
 @protocol XMLDocumentDelegate <NSObject>
 
@@ -8,4 +9,13 @@
   - (void)xmlDocumentDelegateParsingFinished:(XMLDocument *)paramSender;
   - (void)xmlDocumentDelegateParsingFailed:(XMLDocument *)paramSender
                                  withError:(NSError *)paramError;
+
+@optional
+  /* Called once for every element that matches one of the document's
+   queries. paramText is nil unless the query captures text. */
+  - (void)xmlDocument:(XMLDocument *)paramSender
+        didMatchQuery:(XMLQuery *)paramQuery
+          elementName:(NSString *)paramElementName
+           attributes:(NSDictionary *)paramAttributes
+                 text:(NSString *)paramText;
 @end
@@ -3,7 +3,7 @@
 @implementation XMLElement
 
 @synthesize name;
-@synthesize test;
+@synthesize text;
 @synthesize parent;
 @synthesize children;
 @synthesize attributes;
@@ -24,7 +24,6 @@
 }
 
 - (void) dealloc {
-  NSLog(@"Deallocated Element");
   [name release];
   [text release];
   [children release];
@@ -0,0 +1,52 @@
+/*
+ * A path pattern for XMLDocument's streaming query mode.
+ *
+ * Paths are a small subset of XPath:
+ *   /gallery/photo              photo elements directly under the root gallery
+ *   //photo                     photo elements at any depth
+ *   /gallery/*[@id]             any child of gallery that has an id attribute
+ *   //photo[@type='jpeg'][@id]  attribute presence and value predicates
+ *
+ * Predicates may appear on any step. A leading '//' is the only place a
+ * descendant step is allowed, and a path can have at most 32 steps.
+ */
+
+@interface XMLQueryStep : NSObject {
+@public
+  // nil matches any element name
+  NSString *name;
+
+  /* Attribute name -> required value, or NSNull if the attribute only has
+   to be present */
+  NSDictionary *predicates;
+}
+
+@property (nonatomic, copy) NSString *name;
+@property (nonatomic, retain) NSDictionary *predicates;
+
+- (BOOL) matchesElementName:(NSString *)paramName
+                 attributes:(NSDictionary *)paramAttributes;
+
+@end
+
+@interface XMLQuery : NSObject {
+@public
+  NSString *path;
+  NSArray *steps;
+  BOOL matchesAtAnyDepth;
+
+  /* When YES the text inside a matched element (including the text of its
+   descendants) is collected and delivered with the match. When NO, which is
+   the default, the match is delivered as soon as its start tag is seen. */
+  BOOL capturesText;
+}
+
+@property (nonatomic, copy, readonly) NSString *path;
+@property (nonatomic, retain, readonly) NSArray *steps;
+@property (nonatomic, assign, readonly) BOOL matchesAtAnyDepth;
+@property (nonatomic, assign) BOOL capturesText;
+
+/* Designated Initializer. Returns nil if the path can't be parsed. */
+- (id) initWithPath:(NSString *)paramPath;
+
+@end
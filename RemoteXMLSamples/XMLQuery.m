@@ -0,0 +1,144 @@
+#import "XMLQuery.h"
+
+// The streaming matcher keeps one bit per step in a uint32_t.
+static const NSUInteger kXMLQueryMaximumSteps = 32;
+
+@implementation XMLQueryStep
+
+@synthesize name;
+@synthesize predicates;
+
+- (BOOL) matchesElementName:(NSString *)paramName
+                 attributes:(NSDictionary *)paramAttributes {
+  if (name != nil && [name isEqualToString:paramName] == NO) {
+    return NO;
+  }
+
+  for (NSString *attributeName in predicates) {
+    id requiredValue = [predicates objectForKey:attributeName];
+    NSString *actualValue = [paramAttributes objectForKey:attributeName];
+    if (actualValue == nil) {
+      return NO;
+    }
+    if (requiredValue != [NSNull null] &&
+        [actualValue isEqualToString:requiredValue] == NO) {
+      return NO;
+    }
+  }
+  return YES;
+}
+
+- (void) dealloc {
+  [name release];
+  [predicates release];
+  [super dealloc];
+}
+
+@end
+
+@implementation XMLQuery
+
+@synthesize path;
+@synthesize steps;
+@synthesize matchesAtAnyDepth;
+@synthesize capturesText;
+
+/* Parses one step, such as photo[@type='jpeg'], from the scanner. Returns nil
+ if the step is malformed. */
+- (XMLQueryStep *) scanStepWithScanner:(NSScanner *)paramScanner {
+  NSCharacterSet *nameTerminators = 
+    [NSCharacterSet characterSetWithCharactersInString:@"/["];
+  NSString *stepName = nil;
+  NSMutableDictionary *stepPredicates = nil;
+
+  if ([paramScanner scanUpToCharactersFromSet:nameTerminators
+                                   intoString:&stepName] == NO) {
+    return nil;
+  }
+
+  while ([paramScanner scanString:@"[@" intoString:NULL]) {
+    NSString *attributeName = nil;
+    id attributeValue = [NSNull null];
+
+    if ([paramScanner scanUpToCharactersFromSet:
+          [NSCharacterSet characterSetWithCharactersInString:@"=]"]
+                                     intoString:&attributeName] == NO) {
+      return nil;
+    }
+
+    if ([paramScanner scanString:@"=" intoString:NULL]) {
+      NSString *quote = nil;
+      NSString *value = @"";
+      if ([paramScanner scanString:@"'" intoString:&quote] == NO &&
+          [paramScanner scanString:@"\"" intoString:&quote] == NO) {
+        return nil;
+      }
+      [paramScanner scanUpToString:quote intoString:&value];
+      if ([paramScanner scanString:quote intoString:NULL] == NO) {
+        return nil;
+      }
+      attributeValue = value;
+    }
+
+    if ([paramScanner scanString:@"]" intoString:NULL] == NO) {
+      return nil;
+    }
+
+    if (stepPredicates == nil) {
+      stepPredicates = [NSMutableDictionary dictionary];
+    }
+    [stepPredicates setObject:attributeValue forKey:attributeName];
+  }
+
+  XMLQueryStep *step = [[[XMLQueryStep alloc] init] autorelease];
+  if ([stepName isEqualToString:@"*"] == NO) {
+    step.name = stepName;
+  }
+  step.predicates = stepPredicates;
+  return step;
+}
+
+- (id) initWithPath:(NSString *)paramPath {
+  self = [super init];
+  if (self != nil) {
+    NSScanner *scanner = [NSScanner scannerWithString:paramPath];
+    [scanner setCharactersToBeSkipped:nil];
+
+    if ([scanner scanString:@"//" intoString:NULL]) {
+      matchesAtAnyDepth = YES;
+    } else if ([scanner scanString:@"/" intoString:NULL] == NO) {
+      // Paths have to say where they start.
+      [self release];
+      return nil;
+    }
+
+    NSMutableArray *newSteps = [NSMutableArray array];
+    do {
+      XMLQueryStep *step = [self scanStepWithScanner:scanner];
+      if (step == nil || [newSteps count] == kXMLQueryMaximumSteps) {
+        NSLog(@"Cannot parse the XML query path %@", paramPath);
+        [self release];
+        return nil;
+      }
+      [newSteps addObject:step];
+    } while ([scanner scanString:@"/" intoString:NULL]);
+
+    if ([scanner isAtEnd] == NO) {
+      NSLog(@"Cannot parse the XML query path %@", paramPath);
+      [self release];
+      return nil;
+    }
+
+    path = [paramPath copy];
+    steps = [newSteps copy];
+  }
+  return self;
+}
+
+- (void) dealloc {
+  [path release];
+  [steps release];
+  [super dealloc];
+}
+
+@end
@@ -0,0 +1,13 @@
+#import "XMLDocument.h"
+
+/* Compares XMLDocument's full tree build with its streaming query mode on a
+ large, generated photo gallery document. Results go to the console. */
+
+@interface XMLQueryBenchmark : NSObject <XMLDocumentDelegate> {
+@public
+  NSUInteger matchCount;
+}
+
++ (void) runWithPhotoCount:(NSUInteger)paramPhotoCount;
+
+@end
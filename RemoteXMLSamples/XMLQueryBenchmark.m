@@ -0,0 +1,204 @@
+#import "XMLQueryBenchmark.h"
+
+#include <malloc/malloc.h>
+
+/* libmalloc calls malloc_logger, when it's set, for every allocation and 
+ free in the process; it's how the malloc stack logging tools see the 
+ heap. It isn't in a public header, so declare it here. */
+typedef void (MallocLogger)(uint32_t paramType, uintptr_t paramArg1,
+                            uintptr_t paramArg2, uintptr_t paramArg3,
+                            uintptr_t paramResult,
+                            uint32_t paramHotFramesToSkip);
+extern MallocLogger *malloc_logger;
+
+enum {
+  kMallocLogTypeAllocate = 2,
+  kMallocLogTypeDeallocate = 4,
+  kMallocLogTypeHasZone = 8
+};
+
+static MallocLogger *sPreviousMallocLogger;
+static volatile int64_t sAllocationCount;
+static volatile int64_t sAllocatedBytes;
+
+/* Counts every allocation, including ones freed again before the parse 
+ ends, which is what the streaming mode's subtree skipping is meant to 
+ avoid. A realloc is logged as allocate plus deallocate with the new size 
+ in paramArg3; a plain malloc has the size in paramArg2. Other threads' 
+ allocations are counted too, so keep the process otherwise idle. */
+static void CountingMallocLogger(uint32_t paramType, uintptr_t paramArg1,
+                                 uintptr_t paramArg2, uintptr_t paramArg3,
+                                 uintptr_t paramResult,
+                                 uint32_t paramHotFramesToSkip) {
+  if ((paramType & kMallocLogTypeAllocate) != 0 && paramResult != 0) {
+    uintptr_t size = ((paramType & kMallocLogTypeDeallocate) != 0) ?
+      paramArg3 : paramArg2;
+    __sync_add_and_fetch(&sAllocationCount, 1);
+    __sync_add_and_fetch(&sAllocatedBytes, (int64_t)size);
+  }
+  if (sPreviousMallocLogger != NULL) {
+    sPreviousMallocLogger(paramType, paramArg1, paramArg2, paramArg3,
+                          paramResult, paramHotFramesToSkip);
+  }
+}
+
+@implementation XMLQueryBenchmark
+
+/* Builds a gallery document where every photo carries a fair amount of
+ detail that a caller interested only in the photo attributes never reads. */
++ (NSData *) documentWithPhotoCount:(NSUInteger)paramPhotoCount {
+  NSMutableString *xml = [NSMutableString string];
+  NSUInteger index;
+
+  [xml appendString:@"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<gallery>\n"];
+  for (index = 0; index < paramPhotoCount; index++) {
+    [xml appendFormat:
+      @"<photo id=\"%lu\" type=\"%@\">"
+      @"<name>Photo %lu</name>"
+      @"<date>2011-07-16T12:00:00Z</date>"
+      @"<image kind=\"original\" src=\"images/%lu.jpg\"/>"
+      @"<image kind=\"thumbnail\" src=\"thumbnails/%lu.jpg\"/>"
+      @"<exif><camera>iPhone 4</camera><exposure>1/120</exposure>"
+      @"<aperture>2.8</aperture><iso>80</iso></exif>"
+      @"</photo>\n",
+      (unsigned long)index, (index % 2 == 0) ? @"jpeg" : @"png",
+      (unsigned long)index, (unsigned long)index, (unsigned long)index];
+  }
+  [xml appendString:@"</gallery>\n"];
+  return [xml dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+/* What one parse cost: how many allocations it made and how many bytes
+ they asked for, and how much of that was still live at the end, measured
+ while the document is still alive, as that's what a caller holding on to
+ the result pays for. */
+typedef struct {
+  CFAbsoluteTime seconds;
+  long allocations;
+  long allocatedBytes;
+  long liveBytes;
+  long liveBlocks;
+} XMLQueryBenchmarkSample;
+
+static const NSUInteger kXMLQueryBenchmarkRounds = 5;
+
++ (void) heapBytes:(long *)paramBytes blocks:(long *)paramBlocks {
+  malloc_statistics_t statistics;
+  malloc_zone_statistics(NULL, &statistics);
+  *paramBytes = (long)statistics.size_in_use;
+  *paramBlocks = (long)statistics.blocks_in_use;
+}
+
+/* Parses xmlData once, either into a full tree or streaming with a single
+ query for the photo attributes. */
++ (XMLQueryBenchmarkSample) sampleWithData:(NSData *)paramData
+                                  delegate:(XMLQueryBenchmark *)paramDelegate
+                                 streaming:(BOOL)paramStreaming {
+  XMLQueryBenchmarkSample sample;
+  long bytesBefore;
+  long blocksBefore;
+  long bytesAfter;
+  long blocksAfter;
+
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  [self heapBytes:&bytesBefore blocks:&blocksBefore];
+  sAllocationCount = 0;
+  sAllocatedBytes = 0;
+  sPreviousMallocLogger = malloc_logger;
+  malloc_logger = CountingMallocLogger;
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+  XMLDocument *document = [[XMLDocument alloc] initWithDelegate:paramDelegate];
+  if (paramStreaming) {
+    [document addQueryWithPath:@"/gallery/photo"];
+  }
+  [document parseXMLData:paramData];
+  sample.seconds = CFAbsoluteTimeGetCurrent() - start;
+  malloc_logger = sPreviousMallocLogger;
+  sample.allocations = (long)sAllocationCount;
+  sample.allocatedBytes = (long)sAllocatedBytes;
+  [self heapBytes:&bytesAfter blocks:&blocksAfter];
+  sample.liveBytes = bytesAfter - bytesBefore;
+  sample.liveBlocks = blocksAfter - blocksBefore;
+  [document release];
+  [pool drain];
+  return sample;
+}
+
++ (void) logSamples:(XMLQueryBenchmarkSample *)paramSamples
+              label:(NSString *)paramLabel {
+  /* Report the fastest round, which is the one least disturbed by the rest
+   of the system, and the largest heap figures seen. */
+  XMLQueryBenchmarkSample best = paramSamples[0];
+  NSUInteger round;
+  for (round = 1; round < kXMLQueryBenchmarkRounds; round++) {
+    XMLQueryBenchmarkSample sample = paramSamples[round];
+    best.seconds = MIN(best.seconds, sample.seconds);
+    best.allocations = MAX(best.allocations, sample.allocations);
+    best.allocatedBytes = MAX(best.allocatedBytes, sample.allocatedBytes);
+    best.liveBytes = MAX(best.liveBytes, sample.liveBytes);
+    best.liveBlocks = MAX(best.liveBlocks, sample.liveBlocks);
+  }
+  NSLog(@"%@: %.3f sec, %ld allocations totalling %ld bytes during the "
+        @"parse; %ld bytes in %ld blocks still live after it",
+        paramLabel, best.seconds, best.allocations, best.allocatedBytes,
+        best.liveBytes, best.liveBlocks);
+}
+
++ (void) runWithPhotoCount:(NSUInteger)paramPhotoCount {
+  NSData *xmlData = [self documentWithPhotoCount:paramPhotoCount];
+  XMLQueryBenchmark *benchmark = [[XMLQueryBenchmark alloc] init];
+  XMLQueryBenchmarkSample treeSamples[kXMLQueryBenchmarkRounds];
+  XMLQueryBenchmarkSample querySamples[kXMLQueryBenchmarkRounds];
+  NSUInteger round;
+
+  /* Warm up both modes so that neither pays for cold caches, lazily loaded
+   code or the heap growing for the first time. */
+  [self sampleWithData:xmlData delegate:benchmark streaming:NO];
+  [self sampleWithData:xmlData delegate:benchmark streaming:YES];
+
+  /* Alternate which mode goes first so that any ordering effect lands on
+   both equally. */
+  for (round = 0; round < kXMLQueryBenchmarkRounds; round++) {
+    BOOL treeFirst = (round % 2 == 0);
+    if (treeFirst) {
+      treeSamples[round] = 
+        [self sampleWithData:xmlData delegate:benchmark streaming:NO];
+    }
+    benchmark->matchCount = 0;
+    querySamples[round] = 
+      [self sampleWithData:xmlData delegate:benchmark streaming:YES];
+    if (!treeFirst) {
+      treeSamples[round] = 
+        [self sampleWithData:xmlData delegate:benchmark streaming:NO];
+    }
+  }
+
+  NSLog(@"%lu photos, %lu bytes of XML, best of %lu rounds", 
+        (unsigned long)paramPhotoCount, (unsigned long)[xmlData length],
+        (unsigned long)kXMLQueryBenchmarkRounds);
+  [self logSamples:treeSamples label:@"Tree "];
+  [self logSamples:querySamples label:@"Query"];
+  NSLog(@"Query matched %lu photos", (unsigned long)benchmark->matchCount);
+  [benchmark release];
+}
+
+- (void) xmlDocumentDelegateParsingFinished:(XMLDocument *)paramSender {
+}
+
+- (void) xmlDocumentDelegateParsingFailed:(XMLDocument *)paramSender
+                                withError:(NSError *)paramError {
+  NSLog(@"The benchmark document failed to parse: %@", paramError);
+}
+
+- (void)xmlDocument:(XMLDocument *)paramSender
+      didMatchQuery:(XMLQuery *)paramQuery
+        elementName:(NSString *)paramElementName
+         attributes:(NSDictionary *)paramAttributes
+               text:(NSString *)paramText {
+  // Touch what a real caller would read.
+  if ([paramAttributes objectForKey:@"id"] != nil) {
+    matchCount++;
+  }
+}
+
+@end